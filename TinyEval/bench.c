@@ -0,0 +1,124 @@
+/*
+
+Lexer micro-benchmark for WANE's Tiny Evaluator.
+
+Builds on its own, since it pulls in te.c to reach the scanners:
+
+	cc -O2 bench.c -o bench
+
+Each built-in scanner that the running CPU supports tokenizes the same
+multi-megabyte inputs, and the best of several runs is reported.
+
+*/
+
+#include <time.h>
+
+#include "te.c"
+
+#define BENCH_SIZE (8 * 1024 * 1024)
+#define BENCH_RUNS 5
+
+/* Repeats form up to size bytes, cut after the last complete copy. */
+static char* bench_fill(const char *form, size_t size)
+{
+	size_t length = strlen(form);
+	char *out = malloc(size + 1);
+	size_t i;
+
+	assert(out);
+
+	for (i = 0; i + length <= size; i += length)
+		memcpy(out + i, form, length);
+
+	out[i] = '\0';
+	return out;
+}
+
+static const char bench_code[] =
+	"(define (good-enough-with-a-long-name guess tolerance)\n"
+	"        (< (abs-value (- radicand (square guess))) tolerance))\n"
+	"(display \"The square-root of the radicand is \")\n";
+
+static const char bench_data[] =
+	"(record \"customer name with some spaces in it\" \"an escaped \\\"quote\\\" too\"\n"
+	"        12345.678 identifier-with-a-rather-long-name)\n";
+
+static char* bench_blob(size_t size)
+{
+	char *out = malloc(size + 1);
+	size_t i;
+
+	assert(out);
+
+	/* Long string literals separated by a little indentation. */
+	for (i = 0; i < size; i++)
+		out[i] = (i % 4096 == 0 || i % 4096 == 4089) ? '"' : (i % 4096 > 4089 ? ' ' : 'a' + i % 26);
+
+	for (i = size; i > 0 && out[i - 1] != ' '; i--);
+	out[i] = '\0';
+	return out;
+}
+
+static void bench_run(const char *title, const char *input)
+{
+	tiny_eval *te = te_init();
+	size_t size = strlen(input);
+	int i, run;
+
+	printf("%s (%.1f MB)\n", title, size / (1024.0 * 1024.0));
+
+	for (i = 0; te_scanners[i]; i++)
+	{
+		const te_scanner *scanner = te_scanners[i];
+		double best = -1;
+		int tokens = 0;
+
+		if (scanner->supported && !scanner->supported())
+			continue;
+
+		te_scan = scanner;
+
+		for (run = 0; run < BENCH_RUNS; run++)
+		{
+			te_lexer lexer;
+			clock_t start;
+			double elapsed;
+
+			te_lexer_init(&lexer);
+			start = clock();
+			te_lex(te, &lexer, input);
+			elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+			tokens = lexer.count;
+			te_lexer_release(&lexer);
+
+			if (best < 0 || elapsed < best)
+				best = elapsed;
+		}
+
+		printf("  %-8s %9d tokens %8.2f ms %8.1f MB/s%s\n",
+			scanner->name, tokens, best * 1000,
+			best > 0 ? size / (1024.0 * 1024.0) / best : 0.0,
+			te_error(te) ? " (error)" : "");
+	}
+
+	te_scan = NULL;
+	te_release(te);
+}
+
+int main(void)
+{
+	char *code = bench_fill(bench_code, BENCH_SIZE);
+	char *data = bench_fill(bench_data, BENCH_SIZE);
+	char *blob = bench_blob(BENCH_SIZE);
+
+	bench_run("code", code);
+	bench_run("string data", data);
+	bench_run("long strings", blob);
+
+	free(code);
+	free(data);
+	free(blob);
+
+	return 0;
+}
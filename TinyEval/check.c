@@ -0,0 +1,412 @@
+/*
+
+Regression checks for WANE's Tiny Evaluator.
+
+Builds against the interpreter like any other host:
+
+	cc check.c te.c -o check
+
+Each check evaluates a script and compares what it gives back with the
+result expected of it. Failures are reported, and counted in the exit
+status.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "te.h"
+
+static int check_failed = 0;
+
+static void check_fail(const char *name, const char *expression, const char *reason)
+{
+	printf("%s: %s\n\t%s\n", name, reason, expression);
+	check_failed++;
+}
+
+/* Evaluates expression and checks it gives the number expected. */
+static void check_number(tiny_eval *te, const char *name, const char *expression, double expected)
+{
+	te_object *result = te_eval(te, expression);
+
+	if (te_error(te))
+		check_fail(name, expression, te_error(te));
+	else if (!result || te_to_number(result) != expected)
+		check_fail(name, expression, "wrong result");
+
+	te_object_release(result);
+}
+
+/* Checks that the frames of nested closures live as long as they do. */
+static void check_closures(void)
+{
+	tiny_eval *te = te_init();
+
+	check_number(te, "closures", "(define (ff x) (lambda (y) (lambda (z) (+ x y z)))) (((ff 1) 2) 3)", 6);
+	check_number(te, "closures", "(define g ((ff 10) 20)) (g 30)", 60);
+	check_number(te, "closures", "(define (p a) (define (q b) ((lambda (q) q) b)) (q a)) (p 5)", 5);
+
+	te_release(te);
+}
+
+/* Checks (- x) keeps integers exact and negates zeros on every tier, and sums keep -0.0. */
+static void check_negation(void)
+{
+	tiny_eval *te = te_init();
+	double zero[1] = { 0 };
+	double out[1] = { 0 };
+	te_column column;
+	te_column output;
+	te_program *program;
+
+	check_number(te, "negation", "(if (< (/ 1 (- 0.0)) 0) 1 0)", 1);
+	check_number(te, "negation", "(if (> (/ 1 (- -0.0)) 0) 1 0)", 1);
+	check_number(te, "negation", "(if (< (/ 1 (+ -0.0 -0.0 -0.0)) 0) 1 0)", 1);
+	check_number(te, "negation", "(if (< (/ 1 (+ -0.0)) 0) 1 0)", 1);
+	check_number(te, "negation", "(- (- 9007199254740993) -9007199254740993)", 0);
+
+	/* Called through an if so as not to be inlined, often enough to compile. */
+	check_number(te, "negation",
+		"(define (neg x) (/ 1 (- x)))"
+		"(define (loop i n) (if (= i 0) n (loop (- i 1) (+ n (if (< ((if (< i 0) 0 neg) 0.0) 0) 1 0)))))"
+		"(loop 2000 0)", 2000);
+
+	column.name = "x";
+	column.type = TE_TYPE_NUMBER;
+	column.data = zero;
+	output.name = NULL;
+	output.type = TE_TYPE_NUMBER;
+	output.data = out;
+
+	program = te_compile(te, "(/ 1 (- x))");
+
+	if (te_eval_batch(te, program, &column, 1, &output, 1) != 1 || !(out[0] < 0))
+		check_fail("negation", "(/ 1 (- x)) over a column", "wrong result");
+
+	te_program_release(program);
+	te_release(te);
+}
+
+/* Checks tail calls with and without operands run in constant space. */
+static void check_tail_calls(void)
+{
+	tiny_eval *te = te_init();
+
+	/* The operator is picked at run time so the call is not inlined. */
+	check_number(te, "tail calls", "(define (f0) 7) ((lambda (q) ((if (< q 2) f0 f0))) 1)", 7);
+	check_number(te, "tail calls", "(define (loop i n) (if (= i 0) n (loop (- i 1) (+ n 1)))) (loop 1000000 0)", 1000000);
+
+	te_release(te);
+}
+
+/*
+ * Checks a memory limit stops a runaway script, and a script too long
+ * for it, and is not held against the next.
+ */
+static void check_memory_limit(void)
+{
+	const char *deep = "(define (deep n) (if (= n 0) 0 (+ 1 (deep (- n 1))))) (deep 10000000)";
+	static char wide[1 << 20];
+	tiny_eval *te = te_init();
+	te_object *result;
+	te_stats stats;
+	size_t length = 0;
+	int i;
+
+	te_set_memory_limit(te, 1000000);
+
+	result = te_eval(te, deep);
+	te_stats_get(te, &stats);
+
+	if (!te_error(te) || strcmp(te_error(te), "memory: limit exceeded") != 0)
+		check_fail("memory limit", deep, "no limit error");
+	/* Nothing but the copy of the error message may go over. */
+	else if (stats.bytes_peak > 1000000 + 64)
+		check_fail("memory limit", deep, "went over the limit");
+
+	te_object_release(result);
+
+	check_number(te, "memory limit", "(+ 1 2)", 3);
+	check_number(te, "memory limit", "(deep 1000)", 1000);
+
+	/* No calls, so only the compile can fail it, and frees what it took. */
+	for (i = 0; i < 30000; i++)
+		length += sprintf(wide + length, "(define v%d %d.5) ", i, i);
+
+	result = te_eval(te, wide);
+	te_stats_get(te, &stats);
+
+	if (result || !te_error(te) || strcmp(te_error(te), "memory: limit exceeded") != 0)
+		check_fail("memory limit", "(define v0 0.5) ... (define v29999 29999.5)", "no limit error");
+	else if (stats.bytes > 1000000)
+		check_fail("memory limit", "(define v0 0.5) ... (define v29999 29999.5)", "kept what it took");
+
+	te_object_release(result);
+
+	check_number(te, "memory limit", "(deep 1000)", 1000);
+
+	te_release(te);
+}
+
+#define CHECK_ROWS 3000
+
+/*
+ * Checks te_eval_batch writes what te_run gives for each row, over
+ * chunks that run as kernels, chunks whose integers overflow, and
+ * rows that call a lambda often enough for it to be compiled.
+ */
+static void check_batch_formula(tiny_eval *te, const char *expression, te_type type, te_column columns[3])
+{
+	static double number[CHECK_ROWS];
+	static unsigned char boolean[CHECK_ROWS];
+	te_column output;
+	te_program *program;
+	te_object *result;
+	int failed = 0;
+	int row;
+
+	output.name = NULL;
+	output.type = type;
+	output.data = type == TE_TYPE_NUMBER ? (void*)number : (void*)boolean;
+
+	program = te_compile(te, expression);
+
+	if (te_eval_batch(te, program, columns, 3, &output, CHECK_ROWS) != CHECK_ROWS)
+		check_fail("batch", expression, te_error(te) ? te_error(te) : "rows missing");
+
+	for (row = 0; row < CHECK_ROWS && !failed; row++)
+	{
+		double value;
+
+		te_define(te, "a", te_make_int64(((te_int64*)columns[0].data)[row]));
+		te_define(te, "b", te_make_number(((double*)columns[1].data)[row]));
+		te_define(te, "c", te_make_boolean(((unsigned char*)columns[2].data)[row]));
+
+		result = te_run(te, program);
+
+		if (te_error(te))
+			failed = 1;
+		else if (type == TE_TYPE_BOOLEAN)
+			failed = te_to_boolean(result) != boolean[row];
+		else
+			failed = (value = te_to_number(result), memcmp(&value, &number[row], sizeof(double)) != 0);
+
+		te_object_release(result);
+	}
+
+	if (failed)
+		check_fail("batch", expression, "differs from te_run");
+
+	te_program_release(program);
+}
+
+static void check_batch(void)
+{
+	static te_int64 a[CHECK_ROWS];
+	static double b[CHECK_ROWS];
+	static unsigned char c[CHECK_ROWS];
+	te_column columns[3];
+	tiny_eval *te = te_init();
+	int row;
+
+	for (row = 0; row < CHECK_ROWS; row++)
+	{
+		a[row] = row < 700 ? row * 37 % 101 - 50 : ((te_int64)1 << 62) - row;
+		b[row] = row % 7 == 0 ? 0.0 : (row % 13) * 0.25 - 1;
+		c[row] = (unsigned char)(row % 3 == 0);
+	}
+
+	columns[0].name = "a";
+	columns[0].type = TE_TYPE_INTEGER;
+	columns[0].data = a;
+	columns[1].name = "b";
+	columns[1].type = TE_TYPE_NUMBER;
+	columns[1].data = b;
+	columns[2].name = "c";
+	columns[2].type = TE_TYPE_BOOLEAN;
+	columns[2].data = c;
+
+	check_batch_formula(te, "(+ (* a 3) (- b) 1)", TE_TYPE_NUMBER, columns);
+	check_batch_formula(te, "(if (and c (< a b)) (- a) (/ a 2))", TE_TYPE_NUMBER, columns);
+	check_batch_formula(te, "(or c (> (- a) b) (= b 0))", TE_TYPE_BOOLEAN, columns);
+
+	/* k reads a column; the operator is picked per row so it is not inlined. */
+	te_object_release(te_eval(te, "(define (k y) (+ y b))"));
+	check_batch_formula(te, "((if c k k) 0.5)", TE_TYPE_NUMBER, columns);
+
+	te_release(te);
+}
+
+/*
+ * Checks folded, shared and settled forms give what they would as
+ * written, and give way to the builtins they relied on being redefined.
+ * g is called through an if so that its own code runs, not a copy
+ * inlined where it is called, and often enough to be compiled.
+ */
+static void check_optimizer(void)
+{
+	const char *f = "(define (f x) (+ (* 1 x) (+ 0 (* x x)) (* x x) (if (< 1 2) 10 20) (* 2 3)))"
+		"((lambda (q) ((if (< q 2) f f) 3)) 1)";
+	tiny_eval *te = te_init();
+	te_program *program = te_compile(te, f);
+	te_object *result;
+
+	result = te_run(te, program);
+
+	if (te_error(te) || te_to_number(result) != 37)
+		check_fail("optimizer", f, "wrong result");
+
+	te_object_release(result);
+
+	check_number(te, "optimizer",
+		"(define (g x) (+ (* 1 x) (* x x) (* x x)))"
+		"(define (call x) ((if (< x 0) 0 g) x))"
+		"(define (loop i n) (if (= i 0) n (loop (- i 1) (+ n (call 3)))))"
+		"(loop 2000 0)", 42000);
+	check_number(te, "optimizer", "(cond ((and #t (> 2 1)) (- 10 (* 2 2))) (else 0))", 6);
+
+	/* Adding 0 turns -0.0 into 0, so it is not dropped; (* x 1) and (- x 0) are. */
+	check_number(te, "optimizer", "(define (z x) (if (> (/ 1 (+ 0 (- x))) 0) 1 0)) ((if (< 0 1) z z) 0.0)", 1);
+	check_number(te, "optimizer", "(define (z x) (if (> (/ 1 (+ (- x) 0)) 0) 1 0)) ((if (< 0 1) z z) 0.0)", 1);
+	check_number(te, "optimizer", "(define (z x) (if (> (/ 1 (+ 0 x)) 0) 1 0)) ((if (< 0 1) z z) -0.0)", 1);
+	check_number(te, "optimizer", "(define (z x) (if (< (/ 1 (- (* x 1) 0)) 0) 1 0)) ((if (< 0 1) z z) -0.0)", 1);
+
+	/* Compiled forms keep working, now with the new *. */
+	check_number(te, "optimizer", "(define (* a b) (+ a b)) 0", 0);
+
+	result = te_run(te, program);
+
+	if (te_error(te) || te_to_number(result) != 31)
+		check_fail("optimizer", f, "did not give way to (define (* a b) ...)");
+
+	te_object_release(result);
+
+	check_number(te, "optimizer", "(call 3)", 16);
+	check_number(te, "optimizer", "(loop 2000 0)", 32000);
+
+	te_define(te, "*", te_eval(te, "(lambda (a b) (- a b))"));
+	check_number(te, "optimizer", "(call 3)", -2);
+
+	te_program_release(program);
+	te_release(te);
+}
+
+/*
+ * Checks calls inlined where they are made give what the call would,
+ * and are made after all once the lambda they copied is redefined,
+ * whether by define, by te_define, or as a binding local to a body.
+ * h is called through an if so that its own code runs, not a copy
+ * inlined where it is called.
+ */
+static void check_inliner(void)
+{
+	const char *h = "(define (sq x) (* x x)) (define (h y) (+ (sq y) 1))"
+		"(define (call y) ((if (< y 0) 0 h) y)) (call 4)";
+	tiny_eval *te = te_init();
+	te_program *program = te_compile(te, h);
+	te_object *result;
+
+	result = te_run(te, program);
+
+	if (te_error(te) || te_to_number(result) != 17)
+		check_fail("inliner", h, "wrong result");
+
+	te_object_release(result);
+
+	check_number(te, "inliner", "(define (sq x) (+ x x)) (call 3)", 7);
+	check_number(te, "inliner", "(define sq -) (call 3)", -2);
+
+	te_define(te, "sq", te_eval(te, "(lambda (x) (- x 1))"));
+	check_number(te, "inliner", "(call 3)", 3);
+
+	result = te_run(te, program);
+
+	if (te_error(te) || te_to_number(result) != 17)
+		check_fail("inliner", h, "did not inline the sq it defines");
+
+	te_object_release(result);
+
+	check_number(te, "inliner",
+		"(define (outer a) (define tw (lambda (b) (* 2 b))) (define r (tw a))"
+		"(define tw (lambda (b) (* 3 b))) (+ r (tw a)))"
+		"(outer 1)", 5);
+
+	/* k is compiled with the first tw in view, but runs with the second. */
+	check_number(te, "inliner",
+		"(define (later a) (define tw (lambda (b) (* 2 b))) (define k (lambda () (tw a)))"
+		"(define tw (lambda (b) (* 3 b))) (k))"
+		"(later 1)", 3);
+
+	te_program_release(program);
+	te_release(te);
+}
+
+/* Checks atoms end at whitespace or ), whichever scanner runs, however long. */
+static void check_atoms(void)
+{
+	tiny_eval *te = te_init();
+
+	check_number(te, "atoms", "(define a(b 5) (+ a(b 1)", 6);
+	check_number(te, "atoms", "(define q\"r 7) q\"r", 7);
+	check_number(te, "atoms",
+		"(define an-atom-long-enough-for-every-scanner-to-run-a-vector-loop(\"x 2)"
+		"(* an-atom-long-enough-for-every-scanner-to-run-a-vector-loop(\"x 3)", 6);
+
+	te_release(te);
+}
+
+/* Checks integers past 2^53, and past long where that is 32 bits, stay exact. */
+static void check_integers(void)
+{
+	const char *expression = "(- (* big 2) 1)";
+	te_int64 big = ((te_int64)1 << 53) + 1;
+	tiny_eval *te = te_init();
+	te_object *result;
+
+	te_define(te, "big", te_make_int64(big));
+	result = te_eval(te, expression);
+
+	if (te_error(te))
+		check_fail("integers", expression, te_error(te));
+	else if (te_object_type(result) != TE_TYPE_INTEGER || te_to_int64(result) != big * 2 - 1)
+		check_fail("integers", expression, "wrong result");
+
+	te_object_release(result);
+	te_release(te);
+}
+
+/* Checks nil reaches the host as the nil object, not as NULL. */
+static void check_nil(void)
+{
+	const char *expression = "(define (f) #!unspecific) (f)";
+	tiny_eval *te = te_init();
+	te_object *result = te_eval(te, expression);
+
+	if (te_error(te))
+		check_fail("nil", expression, te_error(te));
+	else if (result != te_make_nil() || te_object_type(result) != TE_TYPE_NIL)
+		check_fail("nil", expression, "not the nil object");
+
+	te_object_release(result);
+	te_release(te);
+}
+
+int main(void)
+{
+	check_closures();
+	check_negation();
+	check_tail_calls();
+	check_memory_limit();
+	check_nil();
+	check_integers();
+	check_atoms();
+	check_batch();
+	check_optimizer();
+	check_inliner();
+
+	if (check_failed)
+		printf("%d checks failed\n", check_failed);
+
+	return check_failed != 0;
+}
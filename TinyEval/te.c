@@ -25,6 +25,11 @@ wane <newsheep@gmail.com>
 
 */
 
+/* mmap's MAP_ANON and strcasecmp are left out of strict C modes. */
+#if !defined(_MSC_VER) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
@@ -39,80 +44,659 @@ wane <newsheep@gmail.com>
 #define strncasecmp _strnicmp
 #endif
 
+/*
+ * The lexer classifies 16 or 32 bytes at a time where SSE2 or AVX2 is
+ * available. Define TE_NO_SIMD to build with the scalar scanner only.
+ */
+#if !defined(TE_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || \
+	(defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define TE_SIMD_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(TE_SIMD_SSE2) && (defined(__GNUC__) || (defined(_MSC_VER) && _MSC_VER >= 1800))
+#define TE_SIMD_AVX2
+#include <immintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TE_TARGET_AVX2
+#else
+#define TE_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+/*
+ * Hot numeric lambdas are compiled to native code on x86-64. Define
+ * TE_NO_JIT to keep every call in the interpreter.
+ */
+#if !defined(TE_NO_JIT) && (defined(__x86_64__) || defined(_M_X64)) && \
+	(defined(_WIN32) || defined(__unix__) || defined(__APPLE__))
+#define TE_JIT
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#if !defined(MAP_ANON) && defined(MAP_ANONYMOUS)
+#define MAP_ANON MAP_ANONYMOUS
+#endif
+#ifndef MAP_ANON
+#undef TE_JIT
+#endif
+#endif
+#endif
+
 #define UNUSED(x) (void)(x)
 
+#if defined(_MSC_VER)
+#define TE_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define TE_THREAD_LOCAL __thread
+#else
+#define TE_THREAD_LOCAL
+#endif
+
+#ifdef _MSC_VER
+typedef unsigned __int64 te_value;
+#define TE_INT64_FORMAT "%I64d"
+#define te_strtoi64 _strtoi64
+#else
+typedef unsigned long long te_value;
+#define TE_INT64_FORMAT "%lld"
+#define te_strtoi64 strtoll
+#endif
+
+#define TE_INT64_MAX ((te_int64)(~(te_value)0 >> 1))
+#define TE_INT64_MIN (-TE_INT64_MAX - 1)
+
+/*
+ * Inside the evaluator a value is a double, or a quiet NaN whose top 16
+ * bits tag nil, a boolean, a 48-bit integer or a pointer to a boxed
+ * object. NaNs that arithmetic produces are canonicalized, so no double
+ * ever reads as a tag. Only strings, procedures, userdata and integers
+ * too wide for 48 bits are boxed. UNBOUND marks empty slots and cells
+ * and never reaches the value stack.
+ */
+#define TE_TAG_NIL     0xFFF9
+#define TE_TAG_BOOLEAN 0xFFFA
+#define TE_TAG_INTEGER 0xFFFB
+#define TE_TAG_OBJECT  0xFFFC
+
+#define TE_VALUE_TAG(v)     ((unsigned int)((v) >> 48))
+#define TE_VALUE_PAYLOAD(v) ((v) & ((((te_value)1) << 48) - 1))
+#define TE_VALUE_MAKE(t, p) ((((te_value)(t)) << 48) | TE_VALUE_PAYLOAD((te_value)(p)))
+
+#define TE_VALUE_NIL     TE_VALUE_MAKE(TE_TAG_NIL, 0)
+#define TE_VALUE_UNBOUND TE_VALUE_MAKE(TE_TAG_NIL, 1)
+#define TE_VALUE_FALSE   TE_VALUE_MAKE(TE_TAG_BOOLEAN, 0)
+#define TE_VALUE_TRUE    TE_VALUE_MAKE(TE_TAG_BOOLEAN, 1)
+#define TE_VALUE_NAN     (((te_value)0x7FF8) << 48)
+
+#define TE_VALUE_IS_NUMBER(v)  ((v) < (((te_value)TE_TAG_NIL) << 48))
+#define TE_VALUE_IS_OBJECT(v)  (TE_VALUE_TAG(v) == TE_TAG_OBJECT)
+#define TE_VALUE_IS_BOOLEAN(v) (TE_VALUE_TAG(v) == TE_TAG_BOOLEAN)
+#define TE_VALUE_OBJECT(v)     ((te_object*)(size_t)TE_VALUE_PAYLOAD(v))
+#define TE_VALUE_BOOLEAN(v)    ((int)((v) & 1))
+#define TE_VALUE_FROM_BOOLEAN(b) ((b) ? TE_VALUE_TRUE : TE_VALUE_FALSE)
+
+/*
+ * Procedures built into the evaluator work on values directly, while
+ * those from the host take boxed objects through te_procedure.
+ */
+#define TE_NATIVE(name) te_value name\
+	(tiny_eval *te, void *user, te_value operands[], int count)
+
+typedef TE_NATIVE((*te_native));
+
+/*
+ * The frame of one lambda call. Parameters take the first slots and the
+ * names it defines the rest, in the order the compiler assigned them;
+ * link is the frame the lambda was created in. Frames that closures may
+ * capture live on the heap and are counted by ref, the rest are carved
+ * from the interpreter stack with a ref of zero.
+ */
 struct tag_te_environment
 {
+	int ref;
+	unsigned int mark;
 	struct tag_te_environment *link;
-	struct tag_te_symbol *symbol;
-	int symbol_count;
-	int symbol_cap;
+	te_value *slot;
+	int slot_count;
+};
+
+#define TE_STACK_BLOCK 65536
+#define TE_REGION_BLOCK 65536
+
+/*
+ * A block of the interpreter stack or of a region, with its bytes
+ * following the header. The stack holds frames and the value stack
+ * windows of running code. Its blocks stay chained once allocated, so
+ * it grows without moving anything already carved from it, and
+ * procedures can be handed a window into it.
+ */
+struct tag_te_stack_block
+{
+	struct tag_te_stack_block *prev;
+	struct tag_te_stack_block *next;
+	size_t size;
+	size_t top;
+};
+
+/*
+ * The bump allocator behind te_eval_region, newest block first. While
+ * active, new objects are carved from it and made immortal, so nothing
+ * is counted or freed until te_region_reset drops every block at once.
+ * final keeps the lambdas made meanwhile, to let go of their function
+ * and frame at the reset, and results that came from outside the region.
+ */
+struct tag_te_region
+{
+	struct tag_te_stack_block *block;
+	te_object **final;
+	int final_count;
+	int final_cap;
+	int active;
+};
+
+#define TE_GC_THRESHOLD 4096
+
+/*
+ * The collector behind te_gc_enable. Objects made while it is enabled
+ * are managed: they are not counted, and object lists them until a
+ * collection finds them unreachable from the globals, the region and
+ * the objects the host rooted. Collections only run between top-level
+ * evaluations, where no frame or value stack holds anything else.
+ * Frames traced by a collection are stamped with its epoch.
+ */
+struct tag_te_gc
+{
+	struct tag_te_object **object;
+	int count;
+	int cap;
+	struct tag_te_object **root;
+	int root_count;
+	int root_cap;
+	struct tag_te_object **gray;
+	int gray_count;
+	int gray_cap;
+	int threshold;
+	unsigned int epoch;
+	unsigned long collections;
+	int enabled;
+};
+
+/*
+ * An interned identifier. The name is stored case-folded, once per
+ * interpreter, so identifiers compare by pointer.
+ */
+struct tag_te_name
+{
+	unsigned int hash;
+	int id;
+	size_t length;
+	char name[1];
+};
+
+/*
+ * Special form keywords are interned first by te_init, so their names
+ * take the ids below TE_KEYWORD_COUNT and a form is told apart by id.
+ */
+#define TE_KEYWORD_DEFINE 0
+#define TE_KEYWORD_LAMBDA 1
+#define TE_KEYWORD_COND   2
+#define TE_KEYWORD_IF     3
+#define TE_KEYWORD_AND    4
+#define TE_KEYWORD_OR     5
+#define TE_KEYWORD_ELSE   6
+#define TE_KEYWORD_COUNT  7
+
+struct tag_te_names
+{
+	struct tag_te_name **slot;
+	int count;
+	int cap;
+};
+
+/*
+ * The global environment, hashed on the interned name. Symbols are
+ * allocated one by one so their addresses survive the table growing.
+ */
+struct tag_te_globals
+{
+	struct tag_te_symbol **slot;
+	int count;
+	int cap;
+};
+
+/* Where a tail call keeps its operands while the caller's frame goes. */
+struct tag_te_tail
+{
+	te_value *operand;
+	int cap;
+};
+
+/* The values native code computes with, shared by every call into it. */
+struct tag_te_scratch
+{
+	te_value *value;
+	int cap;
+};
+
+#define TE_MAX_DEPTH 100000
+
+/*
+ * The callers of the lambdas te_execute is running, innermost last.
+ * nested counts the runs of te_execute itself, which procedures can
+ * enter again through te_call, each on the C stack. limit caps both
+ * together, unless it is zero.
+ */
+struct tag_te_calls
+{
+	struct tag_te_continuation *record;
+	int count;
+	int cap;
+	int nested;
+	int limit;
 };
 
+/*
+ * env is the innermost local environment, or NULL at the top level.
+ * global_version changes whenever a global is (re)defined.
+ */
 struct tag_tiny_eval
 {
 	char *error;
-	struct tag_te_environment global;
+	struct tag_te_names names;
+	struct tag_te_globals global;
 	struct tag_te_environment *env;
+	struct tag_te_stack_block *stack;
+	unsigned int global_version;
+	struct tag_te_pool *pool;
+	struct tag_te_region region;
+	struct tag_te_gc gc;
+	struct tag_te_tail tail;
+	struct tag_te_calls calls;
+	struct tag_te_scratch scratch;
 };
 
+/*
+ * Objects with a ref of TE_REF_IMMORTAL are statically allocated and
+ * never counted or freed. int_value comes first in data so they can be
+ * initialized in place. Managed objects are never counted either, and
+ * are TE_REF_MARKED while a collection finds them reachable.
+ */
+#define TE_REF_IMMORTAL (-1)
+#define TE_REF_MANAGED  (-2)
+#define TE_REF_MARKED   (-3)
+
 struct tag_te_object
 {
 	int ref;
 	te_type type;
+	struct tag_te_pool *pool;
 	union
 	{
+		te_int64 int_value;
 		struct tag_te_proc_data *procedure;
 		void *userdata;
-		long int_value;
 		double num_value;
 		char *str_value;
 	}
 	data;
 };
 
+/* Exactly one of proc and native is set. */
 struct tag_te_proc_data
 {
 	te_procedure proc;
+	te_native native;
+	void *user;
+};
+
+#define TE_POOL_SLAB 256
+
+/*
+ * The unit objects are allocated in, with room for a procedure's data
+ * right behind the object. Free blocks are chained through next.
+ */
+union tag_te_block
+{
+	struct
+	{
+		struct tag_te_object object;
+		struct tag_te_proc_data procedure;
+	}
+	used;
+	union tag_te_block *next;
+};
+
+struct tag_te_slab
+{
+	struct tag_te_slab *next;
+	union tag_te_block block[TE_POOL_SLAB];
+};
+
+/*
+ * The memory of one interpreter: its object blocks, and the hooks the
+ * rest of its memory is taken from. Objects and other memory point back
+ * at their pool, so once te_release has let go of it, the pool lives on
+ * until the last of them is freed. owner is the interpreter until then.
+ */
+struct tag_te_pool
+{
+	struct tag_te_slab *slab;
+	union tag_te_block *free;
+	int released;
+	te_stats stats;
+	te_alloc_func alloc;
+	te_free_func release;
 	void *user;
+	struct tag_tiny_eval *owner;
+	unsigned long limit;
+	unsigned long chunks;
+	int raising;
+};
+
+/*
+ * The header of memory from te_alloc, naming the pool it came from, or
+ * NULL for malloc, so it can be freed and counted from anywhere.
+ */
+union tag_te_chunk
+{
+	struct
+	{
+		struct tag_te_pool *pool;
+		size_t size;
+	}
+	head;
+	te_value align;
 };
 
+/*
+ * column is set while te_eval_batch binds the symbol to a column, whose
+ * value changes from row to row without a new global_version.
+ */
 struct tag_te_symbol
 {
-	char *name;
-	te_object *object;
+	struct tag_te_name *name;
+	te_value value;
+	int column;
 };
 
 struct tag_te_lambda_data
 {
-	char **binding;
+	struct tag_te_function *function;
+	struct tag_te_environment *link;
+};
+
+/*
+ * Each scanner returns the first byte in [p, end) that ends a run of
+ * whitespace, an atom, or the characters inside a string. An atom ends
+ * at whitespace or a close parenthesis only, so ( and " may appear in
+ * one. The vector scanners have to agree with the scalar ones exactly.
+ */
+struct tag_te_scanner
+{
+	const char *name;
+	int (*supported)(void);
+	const char* (*space)(const char *p, const char *end);
+	const char* (*atom)(const char *p, const char *end);
+	const char* (*string)(const char *p, const char *end);
+};
+
+#define TE_TOKEN_OPEN   0
+#define TE_TOKEN_CLOSE  1
+#define TE_TOKEN_STRING 2
+#define TE_TOKEN_ATOM   3
+#define TE_TOKEN_END    4
+
+/* For parentheses, match is the index of the paired token. */
+struct tag_te_token
+{
+	int type;
+	const char *begin;
+	const char *end;
+	int match;
+};
+
+struct tag_te_lexer
+{
+	struct tag_te_token *token;
+	int count;
+	int cap;
+};
+
+#define TE_NODE_CONSTANT  0
+#define TE_NODE_SYMBOL    1
+#define TE_NODE_DEFINE    2
+#define TE_NODE_PROCEDURE 3
+#define TE_NODE_LAMBDA    4
+#define TE_NODE_COND      5
+#define TE_NODE_CLAUSE    6
+#define TE_NODE_ELSE      7
+#define TE_NODE_IF        8
+#define TE_NODE_AND       9
+#define TE_NODE_OR        10
+#define TE_NODE_APPLY     11
+#define TE_NODE_SEQUENCE  12
+#define TE_NODE_TEMP      13
+
+/*
+ * A parsed form. Constants carry their object, symbols and definitions
+ * their name, and compound forms their sub-forms in child. Lambdas
+ * keep their parameters in binding and their body forms in child.
+ * A form the optimizer rewrote keeps the rewrite in optimized, valid
+ * while the builtins in guard stay bound. temp is the slot a form
+ * saves its value to for later uses, or for a TEMP node, the slot it
+ * reads; it is -1 otherwise.
+ */
+struct tag_te_node
+{
+	int type;
+	struct tag_te_name *name;
+	te_object *object;
+	struct tag_te_node **child;
+	int child_count;
+	int child_cap;
+	struct tag_te_name **binding;
+	int binding_count;
+	struct tag_te_node *optimized;
+	struct tag_te_symbol **guard;
+	int guard_count;
+	int temp;
+};
+
+#define TE_OPCODES(OP) \
+	OP(NIL) \
+	OP(TRUE) \
+	OP(FALSE) \
+	OP(CONSTANT) \
+	OP(LOCAL) \
+	OP(GLOBAL) \
+	OP(DEFINE_LOCAL) \
+	OP(DEFINE_GLOBAL) \
+	OP(TEMP) \
+	OP(TEMP_SET) \
+	OP(LAMBDA) \
+	OP(POP) \
+	OP(JUMP) \
+	OP(JUMP_FALSE) \
+	OP(JUMP_TRUE) \
+	OP(GUARD) \
+	OP(INLINE_GLOBAL) \
+	OP(INLINE_LOCAL) \
+	OP(CALL) \
+	OP(CALL_LOCAL) \
+	OP(CALL_GLOBAL) \
+	OP(TAIL_CALL) \
+	OP(TAIL_CALL_LOCAL) \
+	OP(TAIL_CALL_GLOBAL) \
+	OP(ERROR) \
+	OP(RETURN)
+
+#define TE_OP_ENUM(name) TE_OP_##name,
+enum { TE_OPCODES(TE_OP_ENUM) TE_OP_COUNT };
+#undef TE_OP_ENUM
+
+#define TE_MSG_COND_RESULT 0
+#define TE_MSG_IF_RESULT   1
+#define TE_MSG_IF_END      2
+#define TE_MSG_AND_OPERAND 3
+#define TE_MSG_OR_OPERAND  4
+
+/*
+ * A call site's copy of the procedure in a global cell. It is good for
+ * as long as version matches the interpreter's global version.
+ */
+struct tag_te_cache
+{
+	struct tag_te_symbol *cell;
+	unsigned int version;
+	te_object *procedure;
+	te_native native;
+	void *user;
+};
+
+/*
+ * Compiled bytecode. Each instruction is an opcode followed by its
+ * operands, which index into constant, global, cache and lambda, or
+ * give the frame depth and slot of a local. stack_size is the deepest
+ * the value stack gets while running it.
+ */
+struct tag_te_code
+{
+	int *op;
+	int op_count;
+	int op_cap;
+	te_value *constant;
+	int constant_count;
+	int constant_cap;
+	struct tag_te_symbol **global;
+	int global_count;
+	int global_cap;
+	struct tag_te_cache *cache;
+	int cache_count;
+	int cache_cap;
+	struct tag_te_function **lambda;
+	int lambda_count;
+	int lambda_cap;
+	int depth;
+	int stack_size;
+};
+
+/*
+ * A compiled lambda body. It is shared by the code that creates it and
+ * by every procedure made from it, so it outlives the program it was
+ * compiled from. calls counts the calls made to it while it has no
+ * native code for the current globals. body keeps a copy of the lambda
+ * when it is small enough for calls to it to be inlined.
+ */
+struct tag_te_function
+{
+	int ref;
+	struct tag_te_name *name;
 	int binding_count;
-	char *combination;
-	struct tag_te_environment env;
+	int slot_count;
+	int capture;
+	struct tag_te_code *code;
+	struct tag_te_jit *jit;
+	int calls;
+	struct tag_te_node *body;
+};
+
+/*
+ * The names a lambda's frame holds while its body is compiled, in slot
+ * order. The top level has no frame, so local is zero there and
+ * every name it sees is global. capture is set once the body creates a
+ * lambda, which would link to the frame. procedure is the function of
+ * the lambda each slot was last defined as, if it was; the top level
+ * keeps the global names defined so in its own slots. inlining counts
+ * the inlined calls being compiled inside one another.
+ */
+struct tag_te_scope
+{
+	tiny_eval *te;
+	struct tag_te_code *code;
+	struct tag_te_scope *parent;
+	struct tag_te_name **name;
+	struct tag_te_function **procedure;
+	int count;
+	int cap;
+	int local;
+	int capture;
+	int inlining;
+};
+
+struct tag_te_program
+{
+	struct tag_te_node *body;
+	struct tag_te_code *code;
+};
+
+/*
+ * A caller waiting on a lambda: where it was in its code, its value
+ * stack window and frame, and the lambda it was running, retained.
+ */
+struct tag_te_continuation
+{
+	struct tag_te_code *code;
+	const int *pc;
+	te_value *stack;
+	te_value *sp;
+	struct tag_te_environment *env;
+	struct tag_te_object *held;
 };
 
+typedef struct tag_te_name te_name;
+typedef struct tag_te_names te_names;
+typedef struct tag_te_globals te_globals;
 typedef struct tag_te_symbol te_symbol;
 typedef struct tag_te_environment te_environment;
+typedef struct tag_te_stack_block te_stack_block;
+typedef struct tag_te_region te_region;
+typedef struct tag_te_gc te_gc;
+typedef struct tag_te_tail te_tail;
+typedef struct tag_te_calls te_calls;
+typedef struct tag_te_continuation te_continuation;
 typedef struct tag_te_proc_data te_proc_data;
+typedef union tag_te_block te_block;
+typedef struct tag_te_slab te_slab;
+typedef struct tag_te_pool te_pool;
+typedef union tag_te_chunk te_chunk;
 typedef struct tag_te_lambda_data te_lambda_data;
-
-static te_object* apply(tiny_eval *te, const char *op, te_object *operands[], int count);
-static te_object* eval(tiny_eval *te, const char **exp);
-
-static TE_PROC(te_lambda_proc);
-
-static TE_PROC(te_plus);
-static TE_PROC(te_minus);
-static TE_PROC(te_multiplies);
-static TE_PROC(te_divides);
-static TE_PROC(te_not);
-static TE_PROC(te_equal);
-static TE_PROC(te_lesser);
-static TE_PROC(te_lesser_equal);
-static TE_PROC(te_greater);
-static TE_PROC(te_greater_equal);
-static TE_PROC(te_display);
-static TE_PROC(te_newline);
+typedef struct tag_te_node te_node;
+typedef struct tag_te_code te_code;
+typedef struct tag_te_cache te_cache;
+typedef struct tag_te_function te_function;
+typedef struct tag_te_scope te_scope;
+typedef struct tag_te_scanner te_scanner;
+typedef struct tag_te_token te_token;
+typedef struct tag_te_lexer te_lexer;
+
+static te_node* parse(tiny_eval *te, te_lexer *lexer, int *index);
+te_name* te_intern(tiny_eval *te, const char *begin, const char *end);
+
+static TE_NATIVE(te_lambda_native);
+static void te_function_release(te_function *function);
+static void te_jit_release(struct tag_te_jit *jit);
+static void* te_stack_alloc(tiny_eval *te, size_t size);
+static void te_stack_free(tiny_eval *te, void *p);
+static void* te_alloc(size_t size);
+static void* te_realloc(void *p, size_t size);
+static void te_free(void *p);
+
+static TE_NATIVE(te_plus);
+static TE_NATIVE(te_minus);
+static TE_NATIVE(te_multiplies);
+static TE_NATIVE(te_divides);
+static TE_NATIVE(te_not);
+static TE_NATIVE(te_equal);
+static TE_NATIVE(te_lesser);
+static TE_NATIVE(te_lesser_equal);
+static TE_NATIVE(te_greater);
+static TE_NATIVE(te_greater_equal);
+static TE_NATIVE(te_display);
+static TE_NATIVE(te_newline);
 
 char* te_str_extract(const char *begin, const char *end)
 {
@@ -124,7 +708,7 @@ char* te_str_extract(const char *begin, const char *end)
 	assert(end >= begin);
 
 	length = end - begin;
-	str = malloc(length + 1);
+	str = te_alloc(length + 1);
 	assert(str);
 
 	memcpy(str, begin, length);
@@ -156,1502 +740,7251 @@ int te_is_space(char ch)
 	return 0;
 }
 
-const char* te_close_string(const char *p)
+const char* te_scan_space_scalar(const char *p, const char *end)
 {
-	int skip = 0;
-	int done = 0;
-	assert(*p == '"');
-
-	for (p++; *p && !done; p++)
-	{
-		if (!skip)
-		{
-			if (*p == '"')
-				done = 1;
-			else if (*p == '\\')
-				skip = 1;
-		}
-		else
-		{
-			skip = 0;
-		}
-	}
+	for (; p < end && te_is_space(*p); p++);
 
 	return p;
 }
 
-const char* te_close_brace(const char *p)
+const char* te_scan_atom_scalar(const char *p, const char *end)
 {
-	int count = 1;
-	assert(*p == '(');
-
-	for (p++; *p && count != 0; p++)
-	{
-		if (*p == '(')
-			count++;
-		else if (*p == ')')
-			count--;
-		else if (*p == '"')
-			p = te_close_string(p) - 1;
-	}
+	for (; p < end && !te_is_space(*p) && *p != ')'; p++);
 
 	return p;
 }
 
-const char* te_token_begin(const char *p)
+const char* te_scan_string_scalar(const char *p, const char *end)
 {
-	assert(p);
-
-	for (; *p && te_is_space(*p); p++);
+	for (; p < end && *p != '"' && *p != '\\'; p++);
 
 	return p;
 }
 
-const char* te_token_end(const char *p)
+#ifdef TE_SIMD_SSE2
+
+static int te_first_bit(unsigned int mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+static __m128i te_sse2_space(__m128i v)
 {
-	assert(p);
-	assert(!te_is_space(*p));
-	assert(*p != ')');
+	__m128i m;
 
-	if (*p == '(')
-	{
-		p = te_close_brace(p);
-	}
-	else if (*p == '"')
-	{
-		p = te_close_string(p);
-	}
-	else
-	{
-		for (; *p && !te_is_space(*p) && *p != ')'; p++);
-	}
+	m = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
 
-	return p;
+	return m;
 }
 
-te_type te_object_type(te_object *object)
+const char* te_scan_space_sse2(const char *p, const char *end)
 {
-	return object ? object->type : TE_TYPE_NIL;
+	for (; end - p >= 16; p += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		unsigned int mask = ~_mm_movemask_epi8(te_sse2_space(v)) & 0xFFFF;
+
+		if (mask)
+			return p + te_first_bit(mask);
+	}
+
+	return te_scan_space_scalar(p, end);
 }
 
-te_lambda_data* te_lambda_init(tiny_eval *te)
+const char* te_scan_atom_sse2(const char *p, const char *end)
 {
-	te_lambda_data *lambda;
+	for (; end - p >= 16; p += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		__m128i m = te_sse2_space(v);
+		unsigned int mask;
 
-	lambda = malloc(sizeof(te_lambda_data));
-	assert(lambda);
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(')')));
+		mask = _mm_movemask_epi8(m);
 
-	lambda->binding = NULL;
-	lambda->binding_count = 0;
-	lambda->combination = NULL;
-	lambda->env.link = te->env;
-	lambda->env.symbol = NULL;
-	lambda->env.symbol_cap = 0;
-	lambda->env.symbol_count = 0;
+		if (mask)
+			return p + te_first_bit(mask);
+	}
 
-	return lambda;
+	return te_scan_atom_scalar(p, end);
 }
 
-void te_lambda_release(te_lambda_data *lambda)
+const char* te_scan_string_sse2(const char *p, const char *end)
 {
-	int i;
+	for (; end - p >= 16; p += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		unsigned int mask = _mm_movemask_epi8(_mm_or_si128(
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))));
 
-	assert(lambda);
+		if (mask)
+			return p + te_first_bit(mask);
+	}
 
-	for (i = 0; i < lambda->binding_count; free(lambda->binding[i++]));
+	return te_scan_string_scalar(p, end);
+}
 
-	if (lambda->binding)
-		free(lambda->binding);
+#endif
 
-	if (lambda->combination)
-		free(lambda->combination);
+#ifdef TE_SIMD_AVX2
 
-	for (i = 0; i < lambda->env.symbol_count; i++)
-	{
-		assert(lambda->env.symbol[i].name);
-		free(lambda->env.symbol[i].name);
-		te_object_release(lambda->env.symbol[i].object);
-	}
+/*
+ * Most tokens are short, so the first 16 bytes are probed with SSE2 and
+ * the 32 byte loop only runs over long stretches.
+ */
+static TE_TARGET_AVX2 __m256i te_avx2_space(__m256i v)
+{
+	__m256i m;
 
-	if (lambda->env.symbol)
-		free(lambda->env.symbol);
+	m = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
 
-	free(lambda);
+	return m;
 }
 
-void te_lambda_bindings(te_lambda_data *lambda, const char **exp)
+TE_TARGET_AVX2 const char* te_scan_space_avx2(const char *p, const char *end)
 {
-	const char *start;
-	const char *p;
-	int binding_cap = 0;
+	if (end - p >= 16)
+	{
+		const char *q = te_scan_space_sse2(p, p + 16);
 
-	assert(exp);
-	assert(*exp);
-	assert(lambda);
-	assert(lambda->binding == NULL);
+		if (q < p + 16)
+			return q;
 
-	start = *exp;
+		p = q;
+	}
 
-	while (*start && *start != ')')
+	for (; end - p >= 32; p += 32)
 	{
-		start = te_token_begin(start);
-		p = te_token_end(start);
-
-		if (lambda->binding_count <= binding_cap)
-		{
-			binding_cap += 8;
-			lambda->binding = realloc(lambda->binding, binding_cap);
-			assert(lambda->binding);
-		}
+		__m256i v = _mm256_loadu_si256((const __m256i*)p);
+		unsigned int mask = ~(unsigned int)_mm256_movemask_epi8(te_avx2_space(v));
 
-		lambda->binding[lambda->binding_count++] = te_str_extract(start, p);
-		start = te_token_begin(p);
+		if (mask)
+			return p + te_first_bit(mask);
 	}
 
-	*exp = start;
-}
-
-te_object* te_object_retain(te_object *object)
-{
-	if (object)
-		object->ref++;
-	return object;
+	return te_scan_space_sse2(p, end);
 }
 
-void te_object_release(te_object *object)
+TE_TARGET_AVX2 const char* te_scan_atom_avx2(const char *p, const char *end)
 {
-	if (object)
+	if (end - p >= 16)
 	{
-		if (--object->ref <= 0)
-		{
-			te_type type = te_object_type(object);
-			
-			if (type == TE_TYPE_PROCEDURE)
-			{
-				assert(object->data.procedure);
+		const char *q = te_scan_atom_sse2(p, p + 16);
 
-				if (object->data.procedure->proc == te_lambda_proc)
-					te_lambda_release(object->data.procedure->user);
-
-				free(object->data.procedure);
-			}
-			else if (type == TE_TYPE_STRING)
-			{
-				assert(object->data.str_value);
-				free(object->data.str_value);
-			}
+		if (q < p + 16)
+			return q;
 
-			free(object);
-		}
+		p = q;
 	}
-}
 
-te_object* te_make_nil(void)
-{
-	te_object *out;
+	for (; end - p >= 32; p += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*)p);
+		__m256i m = te_avx2_space(v);
+		unsigned int mask;
 
-	out = malloc(sizeof(te_object));
-	assert(out);
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(')')));
+		mask = (unsigned int)_mm256_movemask_epi8(m);
 
-	out->ref = 1;
-	out->type = TE_TYPE_NIL;
+		if (mask)
+			return p + te_first_bit(mask);
+	}
 
-	return out;
+	return te_scan_atom_sse2(p, end);
 }
 
-te_object* te_make_procedure(te_procedure proc, void *user)
+TE_TARGET_AVX2 const char* te_scan_string_avx2(const char *p, const char *end)
 {
-	te_object *out;
+	if (end - p >= 16)
+	{
+		const char *q = te_scan_string_sse2(p, p + 16);
 
-	assert(proc);
+		if (q < p + 16)
+			return q;
 
-	out = malloc(sizeof(te_object));
-	assert(out);
+		p = q;
+	}
 
-	out->ref = 1;
-	out->type = TE_TYPE_PROCEDURE;
-	out->data.procedure = malloc(sizeof(te_proc_data));
-	assert(out->data.procedure);
-	out->data.procedure->proc = proc;
-	out->data.procedure->user = user;
+	for (; end - p >= 32; p += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*)p);
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))));
 
-	return out;
+		if (mask)
+			return p + te_first_bit(mask);
+	}
+
+	return te_scan_string_sse2(p, end);
 }
 
-te_object* te_make_userdata(void *user)
+static int te_cpu_has_avx2(void)
 {
-	te_object *out;
+#ifdef _MSC_VER
+	int info[4];
 
-	out = malloc(sizeof(te_object));
-	assert(out);
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return 0;
 
-	out->ref = 1;
-	out->type = TE_TYPE_USERDATA;
-	out->data.userdata = user;
+	/* AVX state must be enabled by the OS as well as by the CPU. */
+	__cpuid(info, 1);
+	if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0)
+		return 0;
 
-	return out;
+	if ((_xgetbv(0) & 6) != 6)
+		return 0;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
 }
 
-te_object* te_make_integer(long value)
+#endif
+
+#ifdef TE_SIMD_AVX2
+static const te_scanner te_scanner_avx2 =
 {
-	te_object *out;
+	"avx2",
+	te_cpu_has_avx2,
+	te_scan_space_avx2,
+	te_scan_atom_avx2,
+	te_scan_string_avx2
+};
+#endif
 
-	out = malloc(sizeof(te_object));
-	assert(out);
+#ifdef TE_SIMD_SSE2
+static const te_scanner te_scanner_sse2 =
+{
+	"sse2",
+	NULL,
+	te_scan_space_sse2,
+	te_scan_atom_sse2,
+	te_scan_string_sse2
+};
+#endif
 
-	out->ref = 1;
-	out->type = TE_TYPE_INTEGER;
-	out->data.int_value = value;
+static const te_scanner te_scanner_scalar =
+{
+	"scalar",
+	NULL,
+	te_scan_space_scalar,
+	te_scan_atom_scalar,
+	te_scan_string_scalar
+};
 
-	return out;
+/* Every scanner built in, widest first. */
+static const te_scanner *te_scanners[] =
+{
+#ifdef TE_SIMD_AVX2
+	&te_scanner_avx2,
+#endif
+#ifdef TE_SIMD_SSE2
+	&te_scanner_sse2,
+#endif
+	&te_scanner_scalar,
+	NULL
+};
+
+static const te_scanner *te_scan = NULL;
+
+/*
+ * Picks the widest scanner the running CPU supports. Every candidate
+ * gives the same answers, so racing initializations are harmless.
+ */
+static const te_scanner* te_scanner_select(void)
+{
+	int i;
+
+	for (i = 0; !te_scan; i++)
+	{
+		if (!te_scanners[i]->supported || te_scanners[i]->supported())
+			te_scan = te_scanners[i];
+	}
+
+	return te_scan;
 }
 
-te_object* te_make_number(double number)
+const char* te_close_string(const char *p, const char *end)
 {
-	te_object *out;
+	assert(*p == '"');
 
-	out = malloc(sizeof(te_object));
-	assert(out);
+	for (p++; (p = te_scan->string(p, end)) < end; p++)
+	{
+		if (*p == '"')
+			return p + 1;
 
-	out->ref = 1;
-	out->type = TE_TYPE_NUMBER;
-	out->data.num_value = number;
+		if (++p == end)
+			break;
+	}
 
-	return out;
+	return NULL;
 }
 
-te_object* te_make_str(const char *str)
+void te_lexer_init(te_lexer *lexer)
 {
-	return te_make_string(str, str + strlen(str));
+	lexer->token = NULL;
+	lexer->count = 0;
+	lexer->cap = 0;
 }
 
-te_object* te_make_string(const char *str, const char *end)
+void te_lexer_release(te_lexer *lexer)
 {
-	size_t length;
-	te_object *out;
+	if (lexer->token)
+		te_free(lexer->token);
+}
 
-	assert(str);
-	assert(end);
+static int te_lexer_push(te_lexer *lexer, int type, const char *begin, const char *end)
+{
+	te_token *token;
 
-	out = malloc(sizeof(te_object));
-	assert(out);
+	if (lexer->count >= lexer->cap)
+	{
+		lexer->cap = lexer->cap ? lexer->cap * 2 : 64;
+		lexer->token = te_realloc(lexer->token, sizeof(te_token) * lexer->cap);
+		assert(lexer->token);
+	}
 
-	length = end - str;
-	out->ref = 1;
-	out->type = TE_TYPE_STRING;
-	out->data.str_value = te_str_extract(str, end);
+	token = &lexer->token[lexer->count];
+	token->type = type;
+	token->begin = begin;
+	token->end = end;
+	token->match = -1;
 
-	return out;
+	return lexer->count++;
 }
 
-te_object* te_make_boolean(int value)
+/*
+ * Splits the expression into tokens in a single pass. Every open
+ * parenthesis is paired with its close in match, so skipping a
+ * sub-expression is a single lookup.
+ */
+int te_lex(tiny_eval *te, te_lexer *lexer, const char *expression)
 {
-	te_object *out;
+	int *open = NULL;
+	int open_count = 0;
+	int open_cap = 0;
+	const char *p = expression;
+	const char *stop = expression + strlen(expression);
 
-	out = malloc(sizeof(te_object));
-	assert(out);
+	te_scanner_select();
 
-	out->ref = 1;
-	out->type = TE_TYPE_BOOLEAN;
-	out->data.int_value = !!value;
+	while (!te_error(te))
+	{
+		p = te_scan->space(p, stop);
 
-	return out;
+		if (p == stop)
+		{
+			break;
+		}
+		else if (*p == '(')
+		{
+			if (open_count >= open_cap)
+			{
+				open_cap = open_cap ? open_cap * 2 : 32;
+				open = te_realloc(open, sizeof(int) * open_cap);
+				assert(open);
+			}
+
+			open[open_count++] = te_lexer_push(lexer, TE_TOKEN_OPEN, p, p + 1);
+			p++;
+		}
+		else if (*p == ')')
+		{
+			if (open_count == 0)
+			{
+				te_set_error(te, "eval: unexpected close parenthesis");
+			}
+			else
+			{
+				int close = te_lexer_push(lexer, TE_TOKEN_CLOSE, p, p + 1);
+
+				open_count--;
+				lexer->token[close].match = open[open_count];
+				lexer->token[open[open_count]].match = close;
+			}
+
+			p++;
+		}
+		else if (*p == '"')
+		{
+			const char *end = te_close_string(p, stop);
+
+			if (!end)
+				te_set_error(te, "eval: unexpected end of string");
+			else
+				te_lexer_push(lexer, TE_TOKEN_STRING, p, end);
+
+			p = end;
+		}
+		else
+		{
+			const char *end = te_scan->atom(p, stop);
+
+			te_lexer_push(lexer, TE_TOKEN_ATOM, p, end);
+			p = end;
+		}
+	}
+
+	if (open_count > 0 && !te_error(te))
+		te_set_error(te, "eval: unexpected end of expression");
+
+	te_lexer_push(lexer, TE_TOKEN_END, p, p);
+
+	if (open)
+		te_free(open);
+
+	return !te_error(te);
 }
 
-te_object* te_make_true()
+/* Returns the index of the token following the expression at index. */
+static int te_lexer_skip(te_lexer *lexer, int index)
 {
-	return te_make_boolean(1);
+	te_token *token = &lexer->token[index];
+	return token->type == TE_TOKEN_OPEN ? token->match + 1 : index + 1;
 }
 
-te_object* te_make_false()
+static int te_lexer_count(te_lexer *lexer, int begin, int end)
 {
-	return te_make_boolean(0);
+	int count = 0;
+
+	for (; begin < end; begin = te_lexer_skip(lexer, begin))
+		count++;
+
+	return count;
 }
 
-te_object* te_call(tiny_eval *te, te_object *procedure, te_object *operands[], int count)
+te_type te_object_type(te_object *object)
 {
-	te_object *result = NULL;
+	return object ? object->type : TE_TYPE_NIL;
+}
 
-	assert(procedure);
+static te_value te_value_retain(te_value value)
+{
+	if (TE_VALUE_IS_OBJECT(value))
+		te_object_retain(TE_VALUE_OBJECT(value));
+	return value;
+}
 
-	if (te_object_type(procedure) == TE_TYPE_PROCEDURE)
+static void te_value_release(te_value value)
+{
+	if (TE_VALUE_IS_OBJECT(value))
+		te_object_release(TE_VALUE_OBJECT(value));
+}
+
+static te_type te_value_type(te_value value)
+{
+	switch (TE_VALUE_TAG(value))
 	{
-		result = procedure->data.procedure->proc(
-			te,
-			procedure->data.procedure->user,
-			operands, count);
-	}
+	case TE_TAG_NIL:
+		return TE_TYPE_NIL;
 
-	return result;
+	case TE_TAG_BOOLEAN:
+		return TE_TYPE_BOOLEAN;
+
+	case TE_TAG_INTEGER:
+		return TE_TYPE_INTEGER;
+
+	case TE_TAG_OBJECT:
+		return te_object_type(TE_VALUE_OBJECT(value));
+
+	default:
+		return TE_TYPE_NUMBER;
+	}
 }
 
-void* te_to_userdata(te_object *object)
+static te_value te_value_from_number(double number)
 {
-	void *user = NULL;
+	te_value value;
 
-	assert(object);
+	if (number != number)
+		return TE_VALUE_NAN;
 
-	if (te_object_type(object) == TE_TYPE_USERDATA)
-	{
-		user = object->data.userdata;
-	}
+	memcpy(&value, &number, sizeof(value));
+	return value;
+}
 
-	return user;
+static int te_integer_fits(te_int64 integer)
+{
+	return (integer >> 47) == 0 || (integer >> 47) == -1;
 }
 
-long te_to_integer(te_object *object)
+static te_value te_value_box(te_object *object)
 {
-	long value = 0;
+	te_value value = TE_VALUE_MAKE(TE_TAG_OBJECT, (size_t)object);
 
-	assert(object);
+	assert(TE_VALUE_OBJECT(value) == object);
+	return value;
+}
 
-	if (te_object_type(object) == TE_TYPE_INTEGER)
-	{
-		value = object->data.int_value;
-	}
+/* Integers too wide for 48 bits are boxed. */
+static te_value te_value_from_integer(te_int64 integer)
+{
+	if (te_integer_fits(integer))
+		return TE_VALUE_MAKE(TE_TAG_INTEGER, integer);
 
-	return value;
+	return te_value_box(te_make_int64(integer));
 }
 
-double te_to_number(te_object *object)
+static te_int64 te_value_integer(te_value value)
 {
-	te_type type;
-	double number = 0;
+	if (TE_VALUE_TAG(value) == TE_TAG_INTEGER)
+		return (te_int64)(value << 16) >> 16;
 
-	assert(object);
-	type = te_object_type(object);
+	return TE_VALUE_OBJECT(value)->data.int_value;
+}
 
-	if (type == TE_TYPE_NUMBER)
-	{
-		number = object->data.num_value;
-	}
-	else if (type == TE_TYPE_INTEGER)
+/* Reads a value of type TE_TYPE_NUMBER or TE_TYPE_INTEGER. */
+static double te_value_number(te_value value)
+{
+	double number;
+
+	if (TE_VALUE_IS_NUMBER(value))
 	{
-		number = object->data.int_value;
+		memcpy(&number, &value, sizeof(number));
+		return number;
 	}
 
-	return number;
+	return (double)te_value_integer(value);
 }
 
-const char* te_to_string(te_object *object)
+/* Converts an object the caller keeps, so boxed ones are retained. */
+static te_value te_value_from_object(te_object *object)
 {
-	const char *str = NULL;
+	switch (te_object_type(object))
+	{
+	case TE_TYPE_NIL:
+		return TE_VALUE_NIL;
 
-	assert(object);
+	case TE_TYPE_BOOLEAN:
+		return TE_VALUE_FROM_BOOLEAN(object->data.int_value);
 
-	if (te_object_type(object) == TE_TYPE_STRING)
-	{
-		str = object->data.str_value;
+	case TE_TYPE_NUMBER:
+		return te_value_from_number(object->data.num_value);
+
+	case TE_TYPE_INTEGER:
+		if (te_integer_fits(object->data.int_value))
+			return TE_VALUE_MAKE(TE_TAG_INTEGER, object->data.int_value);
+		break;
 	}
 
-	return str;
+	return te_value_box(te_object_retain(object));
 }
 
-int te_to_boolean(te_object *object)
+/* Converts an object and releases it. */
+static te_value te_value_take(te_object *object)
 {
-	int value = 0;
-	assert(object);
-
-	if (te_object_type(object) == TE_TYPE_BOOLEAN)
-		value = object->data.int_value;
+	te_value value = te_value_from_object(object);
 
+	te_object_release(object);
 	return value;
 }
 
-tiny_eval* te_init(void)
+/* Returns a new reference to value as an object; nil becomes the nil object. */
+static te_object* te_value_to_object(te_value value)
 {
-	tiny_eval *te;
+	switch (TE_VALUE_TAG(value))
+	{
+	case TE_TAG_NIL:
+		return te_make_nil();
 
-	te = malloc(sizeof(tiny_eval));
-	assert(te);
+	case TE_TAG_BOOLEAN:
+		return te_make_boolean(TE_VALUE_BOOLEAN(value));
 
-	te->error = NULL;
-	te->global.link = NULL;
-	te->global.symbol = NULL;
-	te->global.symbol_cap = 0;
-	te->global.symbol_count = 0;
-	te->env = &te->global;
+	case TE_TAG_INTEGER:
+		return te_make_int64(te_value_integer(value));
 
-	te_define(te, "#!unspecific", te_make_nil());
-	te_define(te, "#t", te_make_true());
-	te_define(te, "#f", te_make_false());
-	te_define(te, "+", te_make_procedure(te_plus, NULL));
-	te_define(te, "-", te_make_procedure(te_minus, NULL));
-	te_define(te, "*", te_make_procedure(te_multiplies, NULL));
-	te_define(te, "/", te_make_procedure(te_divides, NULL));
-	te_define(te, "=", te_make_procedure(te_equal, NULL));
-	te_define(te, "<", te_make_procedure(te_lesser, NULL));
-	te_define(te, "<=", te_make_procedure(te_lesser_equal, NULL));
-	te_define(te, ">", te_make_procedure(te_greater, NULL));
-	te_define(te, ">=", te_make_procedure(te_greater_equal, NULL));
-	te_define(te, "not", te_make_procedure(te_not, NULL));
-	te_define(te, "display", te_make_procedure(te_display, NULL));
-	te_define(te, "newline", te_make_procedure(te_newline, NULL));
+	case TE_TAG_OBJECT:
+		return te_object_retain(TE_VALUE_OBJECT(value));
 
-	return te;
+	default:
+		return te_make_number(te_value_number(value));
+	}
 }
 
-void te_release(tiny_eval *te)
+static TE_THREAD_LOCAL te_environment *te_frame_pending = NULL;
+static TE_THREAD_LOCAL int te_frame_releasing = 0;
+
+/*
+ * Closures can chain frames through their slots as deep as a loop runs,
+ * so frames whose count drops to zero wait on te_frame_pending, chained
+ * through link once it is let go of, and the outermost call frees them
+ * one by one. Only the lexical nesting of links is followed directly.
+ */
+static void te_frame_release(te_environment *frame)
 {
 	int i;
-	assert(te);
 
-	if (te->error)
-		free(te->error);
+	if (!frame || --frame->ref > 0)
+		return;
+
+	te_frame_release(frame->link);
+	frame->link = te_frame_pending;
+	te_frame_pending = frame;
+
+	if (te_frame_releasing)
+		return;
+
+	te_frame_releasing = 1;
 
-	for (i = 0; i < te->global.symbol_count; i++)
+	while ((frame = te_frame_pending) != NULL)
 	{
-		assert(te->global.symbol[i].name);
+		te_frame_pending = frame->link;
 
-		free(te->global.symbol[i].name);
-		te_object_release(te->global.symbol[i].object);
+		for (i = 0; i < frame->slot_count; i++)
+			te_value_release(frame->slot[i]);
+
+		te_free(frame);
 	}
 
-	if (te->global.symbol)
-		free(te->global.symbol);
+	te_frame_releasing = 0;
+}
+
+static int te_is_lambda(te_object *object)
+{
+	return object && object->type == TE_TYPE_PROCEDURE && object->data.procedure->native == te_lambda_native;
+}
+
+/* Returns the function of value if it is a lambda, or NULL. */
+static te_function* te_lambda_function(te_value value)
+{
+	te_object *object;
+
+	if (!TE_VALUE_IS_OBJECT(value) || !te_is_lambda(object = TE_VALUE_OBJECT(value)))
+		return NULL;
 
-	free(te);
+	return ((te_lambda_data*)object->data.procedure->user)->function;
 }
 
-te_symbol* te_symbol_env_find(te_environment *env, const char *name)
+/*
+ * Closures kept in the slots of the frame they link to form a cycle.
+ * When those closures are held by nothing but the slots, and the frame
+ * by nothing but them and the held references of the caller, the whole
+ * group is unreachable and the slots are cleared to free it.
+ */
+static void te_frame_collect(te_environment *frame, int held)
 {
+	int inner = 0;
 	int i;
-	te_symbol *out = NULL;
 
-	for (i = env->symbol_count - 1; i >= 0; i--)
+	if (!frame)
+		return;
+
+	for (i = 0; i < frame->slot_count; i++)
+	{
+		te_object *object;
+
+		if (!TE_VALUE_IS_OBJECT(frame->slot[i]))
+			continue;
+
+		object = TE_VALUE_OBJECT(frame->slot[i]);
+
+		if (object->ref == 1 && te_is_lambda(object) &&
+			((te_lambda_data*)object->data.procedure->user)->link == frame)
+			inner++;
+	}
+
+	if (inner > 0 && frame->ref == inner + held)
 	{
-		assert(env->symbol[i].name);
-		if (strcasecmp(name, env->symbol[i].name) == 0)
+		frame->ref++;
+
+		for (i = 0; i < frame->slot_count; i++)
 		{
-			out = &env->symbol[i];
-			break;
+			te_value value = frame->slot[i];
+
+			frame->slot[i] = TE_VALUE_UNBOUND;
+			te_value_release(value);
 		}
-	}
 
-	return out;
+		te_frame_release(frame);
+	}
 }
 
-te_symbol* te_symbol_find(tiny_eval *te, const char *name)
+te_lambda_data* te_lambda_init(tiny_eval *te, te_function *function)
 {
-	te_symbol *out;
-	te_environment *env;
+	te_lambda_data *lambda;
 
-	assert(te);
-	assert(name);
+	lambda = te_alloc(sizeof(te_lambda_data));
+	assert(lambda);
 
-	out = NULL;
-	env = te->env;
+	function->ref++;
+	lambda->function = function;
+	lambda->link = te->env;
 
-	while (env && !out)
+	if (lambda->link)
 	{
-		out = te_symbol_env_find(env, name);
-		env = env->link;
+		assert(lambda->link->ref > 0);
+		lambda->link->ref++;
 	}
 
-	return out;
+	return lambda;
 }
 
-void te_symbol_init(te_symbol *s, const char *name, te_object *object)
+void te_lambda_release(te_lambda_data *lambda)
 {
-	assert(s);
-	assert(name);
+	assert(lambda);
 
-	s->name = te_str_copy(name);
-	s->object = object;
+	te_function_release(lambda->function);
+	te_frame_release(lambda->link);
+
+	te_free(lambda);
 }
 
-void te_symbol_env_define(te_environment *env, const char *name, te_object *object)
-{
-	te_symbol *symbol;
+/*
+ * The interpreter whose pool new objects and memory come from. It is
+ * set while an interpreter is inside te_init, te_define, te_compile,
+ * te_run or te_call, and objects made anywhere else fall back to malloc.
+ */
+static TE_THREAD_LOCAL tiny_eval *te_current = NULL;
 
-	assert(env);
-	assert(name);
-	
-	symbol = te_symbol_env_find(env, name);
-	if (symbol)
-	{
-		te_object_release(symbol->object);
-		symbol->object = object;
-	}
-	else
-	{
-		if (env->symbol_count >= env->symbol_cap)
-		{
-			env->symbol_cap += 8;
-			env->symbol = realloc(env->symbol, sizeof(te_symbol) * env->symbol_cap);
-			assert(env->symbol);
-		}
+static void* te_default_alloc(void *user, size_t size)
+{
+	UNUSED(user);
+	return malloc(size);
+}
 
-		te_symbol_init(&env->symbol[env->symbol_count++], name, object);
-	}
+static void te_default_free(void *user, void *p, size_t size)
+{
+	UNUSED(user);
+	UNUSED(size);
+	free(p);
 }
 
-void te_define(tiny_eval *te, const char *symbol, te_object *object)
+static te_pool* te_pool_init(te_alloc_func alloc, te_free_func release, void *user)
 {
-	te_environment *env;
+	te_pool *pool;
 
-	assert(te);
-	assert(symbol);
+	if (!alloc || !release)
+	{
+		alloc = te_default_alloc;
+		release = te_default_free;
+	}
 
-	env = &te->global;
-	te_symbol_env_define(env, symbol, object);
+	pool = alloc(user, sizeof(te_pool));
+	assert(pool);
+
+	pool->slab = NULL;
+	pool->free = NULL;
+	pool->released = 0;
+	memset(&pool->stats, 0, sizeof(te_stats));
+	pool->alloc = alloc;
+	pool->release = release;
+	pool->user = user;
+	pool->owner = NULL;
+	pool->limit = 0;
+	pool->chunks = 0;
+	pool->raising = 0;
+
+	return pool;
 }
 
-void te_define_local(tiny_eval *te, const char *symbol, te_object *object)
+/*
+ * Whether taking size more bytes would go over the limit of pool, in
+ * which case the error is raised on the interpreter, if it has none.
+ */
+static int te_pool_over(te_pool *pool, size_t size)
 {
-	te_environment *env;
+	if (!pool->limit || pool->stats.bytes + size <= pool->limit)
+		return 0;
 
-	assert(te);
-	assert(te->env);
-	assert(symbol);
+	if (pool->owner && !pool->owner->error && !pool->raising)
+	{
+		pool->raising = 1;
+		te_set_error(pool->owner, "memory: limit exceeded");
+		pool->raising = 0;
+	}
 
-	env = te->env;
-	te_symbol_env_define(env, symbol, object);
+	return 1;
 }
 
-te_object* te_eval(tiny_eval *te, const char *expression)
+/*
+ * Takes size bytes from the hooks of pool. Calls, which are what a
+ * runaway script grows by, are refused before they would go over the
+ * limit. Anything else going over it is not failed, as every caller
+ * counts on getting its memory, but raises the error, so a compile
+ * stops there and a run unwinds at its next call. Without calls a
+ * script only takes memory in proportion to its text.
+ */
+static void* te_pool_take(te_pool *pool, size_t size)
 {
-	te_object *result = NULL;
-	const char **exp;
+	void *p;
 
-	assert(te);
+	te_pool_over(pool, size);
 
-	exp = &expression;
-	te_set_error(te, NULL);
+	p = pool->alloc(pool->user, size);
+	assert(p);
 
-	while (!te_error(te) && *(*exp))
-	{
-		te_object_release(result);
-		result = eval(te, exp);
-		*exp = te_token_begin(*exp);
-	}
+	pool->stats.bytes += size;
+	if (pool->stats.bytes > pool->stats.bytes_peak)
+		pool->stats.bytes_peak = pool->stats.bytes;
 
-	return result;
+	return p;
 }
 
-const char *te_error(tiny_eval *te)
+static void te_pool_give(te_pool *pool, void *p, size_t size)
 {
-	assert(te);
-	return te->error;
+	pool->release(pool->user, p, size);
+	pool->stats.bytes -= size;
 }
 
-void te_set_error(tiny_eval *te, const char *str)
+static void te_pool_destroy(te_pool *pool)
 {
-	assert(te);
-
-	if (te->error)
+	while (pool->slab)
 	{
-		free(te->error);
-		te->error = NULL;
+		te_slab *next = pool->slab->next;
+		te_pool_give(pool, pool->slab, sizeof(te_slab));
+		pool->slab = next;
 	}
 
-	if (str)
-	{
-		te->error = te_str_copy(str);
-	}
+	pool->release(pool->user, pool, sizeof(te_pool));
 }
 
-te_object* apply(tiny_eval *te, const char *op, te_object *operands[], int count)
+/* Called by te_release; the pool goes once its memory is all back too. */
+static void te_pool_release(te_pool *pool)
 {
-	te_object *result;
- 
-	assert(te);
-	assert(op);
-
-	result = NULL;
-
-	if (op[0] == '(')
-	{
-		te_object *fun = te_eval(te, op);
-		if (!te_error(te))
-		{
-			if (te_object_type(fun) == TE_TYPE_PROCEDURE)
-			{
-				result = te_call(te, fun, operands, count);
-			}
-			else
-			{
-				te_set_error(te, "apply: can't eval operator");
-			}
-		}
-		te_object_release(fun);
-	}
-	else
-	{
-		te_symbol *s = te_symbol_find(te, op);
-
-		if (s)
-		{
-			if (te_object_type(s->object) == TE_TYPE_PROCEDURE)
-			{
-				result = te_call(te, s->object, operands, count);
-			}
-			else
-			{
-				te_set_error(te, "apply: operator is not a procedure");
-			}
-		}
-		else
-		{
-			te_set_error(te, "apply: unbound procedure");
-		}
-	}
+	pool->released = 1;
 
-	return result;
+	if (pool->stats.objects == 0 && pool->chunks == 0)
+		te_pool_destroy(pool);
 }
 
-te_object* te_eval_define(tiny_eval *te, const char *exp, const char *end)
+static te_block* te_pool_alloc(te_pool *pool)
 {
-	const char *start;
-	const char *p;
-	char *symbol = NULL;
-	char *combination = NULL;
-	te_object *result = NULL;
-
-	start = te_token_begin(te_token_end(te_token_begin(exp + 1)));
-	p = te_token_end(start);
+	te_block *block;
+	int i;
 
-	if (*start == '(')
+	if (!pool->free)
 	{
-		te_lambda_data *lambda;
+		te_slab *slab = te_pool_take(pool, sizeof(te_slab));
 
-		start = te_token_begin(start + 1);
-		p = te_token_end(start);
-		symbol = te_str_extract(start, p);
+		slab->next = pool->slab;
+		pool->slab = slab;
+		pool->stats.slabs++;
 
-		start = te_token_begin(p);
-		lambda = te_lambda_init(te);
-		te_lambda_bindings(lambda, &start);
+		for (i = 0; i < TE_POOL_SLAB - 1; i++)
+			slab->block[i].next = &slab->block[i + 1];
 
-		if (start < end && *start == ')')
-		{
-			start = te_token_begin(++start);
-			if (start < end && *start)
-			{
-				lambda->combination = te_str_extract(start, end - 1);
-				result = te_make_procedure(te_lambda_proc, lambda);
-				te_define(te, symbol, te_object_retain(result));
-			}
-		}
-		
-		if (!lambda->combination)
-		{
-			te_set_error(te, "define: unexpected end of procedure definition");
-			
-			if (lambda)
-				te_lambda_release(lambda);
-		}
+		slab->block[TE_POOL_SLAB - 1].next = NULL;
+		pool->free = slab->block;
 	}
-	else
-	{
-		symbol = te_str_extract(start, p);
 
-		start = te_token_begin(p);
-		p = te_token_end(start);
-
-		combination = te_str_extract(start, p);
-
-		p = te_token_begin(p);
-		if (*p != ')' || (p + 1) != end)
-		{
-			te_set_error(te, "define: unexpected end of expression");
-		}
-		else
-		{
-			result = te_eval(te, combination);
+	block = pool->free;
+	pool->free = block->next;
 
-			if (!te_error(te))
-			{
-				te_define_local(te, symbol, te_object_retain(result));
-			}
-		}
-	}
+	pool->stats.allocations++;
+	if (++pool->stats.objects > pool->stats.objects_peak)
+		pool->stats.objects_peak = pool->stats.objects;
 
-	if (symbol)
-		free(symbol);
+	return block;
+}
 
-	if (combination)
-		free(combination);
+static void te_pool_free(te_pool *pool, te_block *block)
+{
+	block->next = pool->free;
+	pool->free = block;
 
-	return result;
+	if (--pool->stats.objects == 0 && pool->chunks == 0 && pool->released)
+		te_pool_destroy(pool);
 }
 
-te_object* te_eval_lambda(tiny_eval *te, const char *exp, const char *end)
+static void* te_memory_alloc(te_pool *pool, size_t size)
 {
-	const char *start;
-	const char *p;
-	te_object *result = NULL;
+	te_chunk *chunk;
 
-	start = te_token_begin(te_token_end(te_token_begin(exp + 1)));
-	p = te_token_end(start);
+	size += sizeof(te_chunk);
 
-	if (*start == '(' && *(p - 1) == ')')
+	if (pool)
 	{
-		te_lambda_data *lambda;
-
-		start = te_token_begin(++start);
-		lambda = te_lambda_init(te);
-		te_lambda_bindings(lambda, &start);
-
-		if (start < end && *start == ')')
-		{
-			start = te_token_begin(++start);
-			lambda->combination = te_str_extract(start, end - 1);
-			result = te_make_procedure(te_lambda_proc, lambda);
-		}
-		else
-		{
-			te_set_error(te, "lambda: unexpected end of definition");
-
-			if (lambda)
-				te_lambda_release(lambda);
-		}
+		chunk = te_pool_take(pool, size);
+		pool->chunks++;
 	}
 	else
 	{
-		te_set_error(te, "lambda: invalid expression");
+		chunk = malloc(size);
+		assert(chunk);
 	}
 
-	return result;
+	chunk->head.pool = pool;
+	chunk->head.size = size;
+	return chunk + 1;
 }
 
-te_object* te_eval_cond(tiny_eval *te, const char *exp, const char *end)
+/*
+ * Memory for the interpreter in te_current, from the hooks of its pool,
+ * or from malloc when there is none, like objects.
+ */
+static void* te_alloc(size_t size)
 {
-	const char *start;
-	const char *p;
-	te_object *result = NULL;
-
-	start = te_token_begin(te_token_end(te_token_begin(exp + 1)));
-	p = start;
+	return te_memory_alloc(te_current ? te_current->pool : NULL, size);
+}
 
-	while (p < end - 1 && !te_error(te) && !result)
-	{
-		const char *block = start;
+static void te_free(void *p)
+{
+	te_chunk *chunk;
+	te_pool *pool;
 
-		if (*start == '(')
-		{
-			start = te_token_begin(++start);
-			p = te_token_end(start);
-			if (strncasecmp(start, "else", p - start) == 0)
-			{
-				result = te_make_true();
-				start = p;
-			}
-			else
-			{
-				result = eval(te, &start);
-			}
+	if (!p)
+		return;
 
-			if (start != p)
-			{
-				te_set_error(te, "cond: can't eval condition");
-			}
-			else if (te_object_type(result) != TE_TYPE_BOOLEAN)
-			{
-				te_set_error(te, "cond: unexpected conditional result");
-			}
-			else if (!te_error(te))
-			{
-				int cond = te_to_boolean(result);
-				te_object_release(result);
-				result = NULL;
-
-				if (cond)
-				{
-					start = te_token_begin(p);
-					p = te_token_end(block);
-
-					if (start >= p)
-					{
-						te_set_error(te, "cond: unexpected end of expression");
-					}
-					else
-					{
-						char *combination = te_str_extract(start, p - 1);
-						result = te_eval(te, combination);
-						free(combination);
-					}
-
-					start = te_token_begin(p);
-				}
-				else
-				{
-					p = te_token_begin(te_token_end(block));
-					start = p;
-				}
-			}
+	chunk = (te_chunk*)p - 1;
+	pool = chunk->head.pool;
 
-			if (te_error(te) && result)
-			{
-				te_object_release(result);
-				result = NULL;
-			}
-		}
-		else
-		{
-			te_set_error(te, "cond: unexpected conditional expression");
-		}
+	if (!pool)
+	{
+		free(chunk);
+		return;
 	}
 
-	return result;
+	te_pool_give(pool, chunk, chunk->head.size);
+
+	if (--pool->chunks == 0 && pool->stats.objects == 0 && pool->released)
+		te_pool_destroy(pool);
 }
 
-te_object* te_eval_if(tiny_eval *te, const char *exp, const char *end)
+/*
+ * Memory keeps to the pool it was first taken from. Memory from malloc
+ * is left to realloc, which can often grow it where it is; callers grow
+ * their arrays by doubling, so copies add up to no more than they keep.
+ */
+static void* te_realloc(void *p, size_t size)
 {
-	const char *start;
-	const char *p;
-	te_object *result = NULL;
+	te_chunk *chunk;
+	size_t length;
+	void *out;
 
-	start = te_token_begin(te_token_end(te_token_begin(exp + 1)));
-	p = start;
+	if (!p)
+		return te_alloc(size);
 
-	result = eval(te, &p);
+	chunk = (te_chunk*)p - 1;
+	length = chunk->head.size - sizeof(te_chunk);
 
-	if (!te_error(te))
+	if (!chunk->head.pool)
 	{
-		if (te_object_type(result) == TE_TYPE_BOOLEAN)
-		{
-			int cond = te_to_boolean(result);
-			te_object_release(result);
-			result = NULL;
-
-			if (!cond)
-				p = te_token_end(te_token_begin(p));
+		chunk = realloc(chunk, size + sizeof(te_chunk));
+		assert(chunk);
 
-			p = te_token_begin(p);
-			if (p >= end || !*p || *p == ')')
-			{
-				te_set_error(te, "if: unexpected end of expression");
-			}
-			else
-			{
-				result = eval(te, &p);
-			}
-		}
-		else
-		{
-			te_object_release(result);
-			result = NULL;
-			te_set_error(te, "if: unexpected conditional result");
-		}
+		chunk->head.size = size + sizeof(te_chunk);
+		return chunk + 1;
 	}
 
-	return result;
+	out = te_memory_alloc(chunk->head.pool, size);
+	memcpy(out, p, length < size ? length : size);
+	te_free(p);
+
+	return out;
 }
 
-te_object* te_eval_and(tiny_eval *te, const char *exp, const char *end)
+static te_stack_block* te_stack_block_init(size_t size)
 {
-	const char *start;
-	const char *p;
-	te_object *result = NULL;
-
-	start = te_token_begin(te_token_end(te_token_begin(exp + 1)));
+	te_stack_block *block;
 
-	while (!te_error(te) && *start != ')' && start < end)
-	{
-		p = te_token_end(start);
+	block = te_alloc(sizeof(te_stack_block) + size);
+	assert(block);
 
-		if (p > end)
-		{
-			te_set_error(te, "and: unexpected end of expression");
-		}
-		else if (!result)
-		{
-			te_object *cond = eval(te, &start);
+	block->prev = NULL;
+	block->next = NULL;
+	block->size = size;
+	block->top = 0;
 
-			if (!te_error(te))
-			{
-				if (te_object_type(cond) == TE_TYPE_BOOLEAN)
-				{
-					if (te_to_boolean(cond) == 0)
-					{
-						result = te_make_false();
-					}
-				}
-				else
-				{
-					te_set_error(te, "and: operand is not a boolean value");
-				}
-			}
+	return block;
+}
 
-			te_object_release(cond);
-		}
+static void* te_region_alloc(tiny_eval *te, size_t size)
+{
+	te_stack_block *block = te->region.block;
+	void *out;
 
-		start = te_token_begin(p);
-	}
+	size = (size + 7) & ~(size_t)7;
 
-	if (*start == ')')
-	{
-		if (!result && !te_error(te))
-			result = te_make_true();
-	}
-	else
+	if (!block || block->top + size > block->size)
 	{
-		te_set_error(te, "and: unexpected end of expression");
+		block = te_stack_block_init(size > TE_REGION_BLOCK ? size : TE_REGION_BLOCK);
+		block->next = te->region.block;
+		te->region.block = block;
 	}
 
-	return result;
+	out = (char*)(block + 1) + block->top;
+	block->top += size;
+
+	return out;
 }
 
-te_object* te_eval_or(tiny_eval *te, const char *exp, const char *end)
+static void te_gc_push(te_object ***list, int *count, int *cap, te_object *object)
 {
-	const char *start;
-	const char *p;
-	te_object *result = NULL;
-
-	start = te_token_begin(te_token_end(te_token_begin(exp + 1)));
-
-	while (!te_error(te) && *start != ')' && start < end)
+	if (*count >= *cap)
 	{
-		p = te_token_end(start);
-
-		if (p > end)
-		{
-			te_set_error(te, "or: unexpected end of expression");
-		}
-		else if (!result)
-		{
-			te_object *cond = eval(te, &start);
+		*cap = *cap ? *cap * 2 : 64;
+		*list = te_realloc(*list, sizeof(te_object*) * *cap);
+		assert(*list);
+	}
 
-			if (!te_error(te))
-			{
-				if (te_object_type(cond) == TE_TYPE_BOOLEAN)
-				{
-					if (te_to_boolean(cond) != 0)
-					{
-						result = te_make_true();
-					}
-				}
-				else
-				{
-					te_set_error(te, "or: operand is not a boolean value");
-				}
-			}
+	(*list)[(*count)++] = object;
+}
 
-			te_object_release(cond);
-		}
+/*
+ * Objects from the region are immortal, those made while the collector
+ * is enabled are managed, and the rest start with one ref.
+ */
+static te_object* te_object_alloc(void)
+{
+	te_pool *pool = te_current ? te_current->pool : NULL;
+	te_block *block;
+	int ref = 1;
 
-		start = te_token_begin(p);
+	if (te_current && te_current->region.active)
+	{
+		block = te_region_alloc(te_current, sizeof(te_block));
+		pool = NULL;
+		ref = TE_REF_IMMORTAL;
 	}
+	else if (pool && te_current->gc.enabled)
+	{
+		te_gc *gc = &te_current->gc;
 
-	if (*start == ')')
+		block = te_pool_alloc(pool);
+		ref = TE_REF_MANAGED;
+		te_gc_push(&gc->object, &gc->count, &gc->cap, &block->used.object);
+	}
+	else if (pool)
 	{
-		if (!result && !te_error(te))
-			result = te_make_false();
+		block = te_pool_alloc(pool);
 	}
 	else
 	{
-		te_set_error(te, "or: unexpected end of expression");
+		block = malloc(sizeof(te_block));
+		assert(block);
 	}
 
-	return result;
+	block->used.object.ref = ref;
+	block->used.object.pool = pool;
+	return &block->used.object;
 }
 
-te_object* te_eval_symbol(tiny_eval *te, const char *exp)
+static void te_object_free(te_object *object)
 {
-	te_symbol *s;
-	te_object *result = NULL;
-
-	s = te_symbol_find(te, exp);
-	if (!s || !s->object)
-	{
-		te_set_error(te, "eval: unbound symbol");
-	}
+	if (object->pool)
+		te_pool_free(object->pool, (te_block*)object);
 	else
-	{
-		result = te_object_retain(s->object);
-	}
-
-	return result;
+		free(object);
 }
 
-te_object* eval(tiny_eval *te, const char **exp)
+te_object* te_object_retain(te_object *object)
 {
-	te_object *result = NULL;
-	const char *p;
-	char *field = NULL;
+	if (object && object->ref > 0)
+		object->ref++;
+	return object;
+}
 
-	*exp = te_token_begin(*exp);
-	p = *exp;
+/* Lets go of what object holds, before its block is freed. */
+static void te_object_finalize(te_object *object)
+{
+	te_type type = te_object_type(object);
 
-	if (*p == '(')
+	if (type == TE_TYPE_PROCEDURE)
 	{
-		const char *start;
+		assert(object->data.procedure);
 
-		start = te_token_begin(++p);
-		p = te_token_end(start);
-
-		field = te_str_extract(start, p);
+		if (object->data.procedure->native == te_lambda_native)
+			te_lambda_release(object->data.procedure->user);
+	}
+	else if (type == TE_TYPE_STRING)
+	{
+		assert(object->data.str_value);
+		te_free(object->data.str_value);
+	}
+}
 
-		if (strcasecmp(field, "define") == 0)
-		{
-			p = te_token_end(*exp);
-			result = te_eval_define(te, *exp, p);
-			*exp = p;
-		}
-		else if (strcasecmp(field, "lambda") == 0)
-		{
-			p = te_token_end(*exp);
-			result = te_eval_lambda(te, *exp, p);
-			*exp = p;
-		}
-		else if (strcasecmp(field, "cond") == 0)
-		{
-			p = te_token_end(*exp);
-			result = te_eval_cond(te, *exp, p);
-			*exp = p;
-		}
-		else if (strcasecmp(field, "if") == 0)
-		{
-			p = te_token_end(*exp);
-			result = te_eval_if(te, *exp, p);
-			*exp = p;
-		}
-		else if (strcasecmp(field, "and") == 0)
+void te_object_release(te_object *object)
+{
+	if (object && object->ref > 0)
+	{
+		if (--object->ref <= 0)
 		{
-			p = te_token_end(*exp);
-			result = te_eval_and(te, *exp, p);
-			*exp = p;
+			te_object_finalize(object);
+			te_object_free(object);
 		}
-		else if (strcasecmp(field, "or") == 0)
+		else if (object->ref == 1 && te_is_lambda(object))
 		{
-			p = te_token_end(*exp);
-			result = te_eval_or(te, *exp, p);
-			*exp = p;
+			te_frame_collect(((te_lambda_data*)object->data.procedure->user)->link, 0);
 		}
-		else
-		{
-			te_object **operands = NULL;
-			int operand_cap = 0;
-			int operand_count = 0;
+	}
+}
 
-			while (*p && *p != ')' && !te_error(te))
-			{
-				te_object *operand = eval(te, &p);
-				p = te_token_begin(p);
+static void te_gc_mark(te_gc *gc, te_object *object)
+{
+	if (!object || object->ref == TE_REF_MARKED)
+		return;
 
-				if (te_error(te))
-					break;
+	if (object->ref == TE_REF_MANAGED)
+		object->ref = TE_REF_MARKED;
 
-				if (operand_count >= operand_cap)
-				{
-					operand_cap += 32;
-					operands = realloc(operands, sizeof(te_object*) * operand_cap);
-					assert(operands);
-				}
+	if (te_is_lambda(object))
+		te_gc_push(&gc->gray, &gc->gray_count, &gc->gray_cap, object);
+}
 
-				operands[operand_count++] = operand;
-			}
+/*
+ * Traces the frames of the lambdas found so far. Counted and immortal
+ * lambdas are traced too, as their frames may hold managed objects;
+ * the epoch keeps any frame from being traced twice.
+ */
+static void te_gc_trace(te_gc *gc)
+{
+	while (gc->gray_count > 0)
+	{
+		te_object *object = gc->gray[--gc->gray_count];
+		te_environment *frame = ((te_lambda_data*)object->data.procedure->user)->link;
+		int i;
 
-			if (*p != ')')
-			{
-				if (!te_error(te))
-					te_set_error(te, "eval: unexpected end of expression");
+		for (; frame && frame->mark != gc->epoch; frame = frame->link)
+		{
+			frame->mark = gc->epoch;
 
-				*exp = p;
-			}
-			else
+			for (i = 0; i < frame->slot_count; i++)
 			{
-				if (!te_error(te))
-					result = apply(te, field, operands, operand_count);
-
-				*exp = ++p;
+				if (TE_VALUE_IS_OBJECT(frame->slot[i]))
+					te_gc_mark(gc, TE_VALUE_OBJECT(frame->slot[i]));
 			}
-
-			for (operand_cap = 0; operand_cap < operand_count; te_object_release(operands[operand_cap++]));
-			free(operands);
 		}
 	}
-	else if (*p == '"')
-	{
-		*exp = p;
-		p = te_token_end(*exp);
+}
 
-		if (*(p - 1) != '"')
-		{
-			te_set_error(te, "eval: unexpected end of string");
-		}
-		else
-		{
-			result = te_make_string(*exp + 1, p - 1);
-		}
+/*
+ * Frees the managed objects left unmarked, and unmarks the rest. Every
+ * one of them is finalized before any is freed, as letting go of a
+ * lambda's frame still looks at the objects in its slots.
+ */
+static void te_gc_sweep(te_gc *gc)
+{
+	int live = 0;
+	int i;
 
-		*exp = p;
-	}
-	else if (*p == ')')
-	{
-		te_set_error(te, "eval: unexpected close parenthesis");
-		p++;
-	}
-	else
+	for (i = 0; i < gc->count; i++)
 	{
-		*exp = p;
-		p = te_token_end(p);
-
-		field = te_str_extract(*exp, p);
+		te_object *object = gc->object[i];
 
-		if (strchr(field, '.'))
-		{
-			double num;
-			char *ep;
-
-			num = strtod(field, &ep);
-			if (!*ep)
-			{
-				result = te_make_number(num);
-			}
-			else
-			{
-				result = te_eval_symbol(te, field);
-			}
-		}
-		else
+		if (object->ref == TE_REF_MARKED)
 		{
-			long value;
-			char *ep;
-
-			value = strtol(field, &ep, 10);
-			if (!*ep)
-			{
-				result = te_make_integer(value);
-			}
-			else
-			{
-				result = te_eval_symbol(te, field);
-			}
+			object->ref = TE_REF_MANAGED;
+			gc->object[i] = gc->object[live];
+			gc->object[live++] = object;
 		}
-
-		*exp = p;
 	}
 
-	if (field)
-		free(field);
+	for (i = live; i < gc->count; i++)
+		te_object_finalize(gc->object[i]);
 
-	return result;
+	for (i = live; i < gc->count; i++)
+		te_object_free(gc->object[i]);
+
+	gc->count = live;
 }
 
-TE_PROC(te_lambda_proc)
+/*
+ * Collects the managed objects that can no longer be reached. While te
+ * is running code, its frames and value stacks hold objects nothing
+ * here can see, so a collection asked for then does nothing.
+ */
+void te_gc_collect(tiny_eval *te)
 {
+	te_gc *gc;
 	int i;
-	te_lambda_data *lambda;
-	te_object *result = NULL;
 
 	assert(te);
-	assert(user);
 
-	lambda = user;
+	if (te_current == te)
+		return;
 
-	if (lambda->binding_count == count)
-	{
-		te_environment *prev = te->env;
-		te->env = &lambda->env;
-
-		for (i = 0; i < count; i++)
-			te_define_local(te, lambda->binding[i], te_object_retain(operands[i]));
+	gc = &te->gc;
 
-		result = te_eval(te, lambda->combination);
+	if (++gc->epoch == 0)
+		gc->epoch = 1;
 
-		te->env = prev;
-	}
-	else
+	for (i = 0; i < te->global.cap; i++)
 	{
-		te_set_error(te, "lambda: mismatch operand count");
+		if (te->global.slot[i] && TE_VALUE_IS_OBJECT(te->global.slot[i]->value))
+			te_gc_mark(gc, TE_VALUE_OBJECT(te->global.slot[i]->value));
 	}
 
-	return result;
+	for (i = 0; i < gc->root_count; i++)
+		te_gc_mark(gc, gc->root[i]);
+
+	for (i = 0; i < te->region.final_count; i++)
+		te_gc_mark(gc, te->region.final[i]);
+
+	te_gc_trace(gc);
+	te_gc_sweep(gc);
+
+	gc->threshold = gc->count * 2 > TE_GC_THRESHOLD ? gc->count * 2 : TE_GC_THRESHOLD;
+	gc->collections++;
 }
 
-static double te_extract_number(tiny_eval *te, te_object *object, te_type *type)
+/*
+ * Objects made while the collector is enabled need not be released,
+ * but those the host keeps past the next evaluation must be rooted.
+ * Objects made before stay counted either way.
+ */
+void te_gc_enable(tiny_eval *te, int enabled)
 {
 	assert(te);
-	assert(object);
-	assert(type);
+	te->gc.enabled = enabled;
+}
+
+void te_gc_root(tiny_eval *te, te_object *object)
+{
+	tiny_eval *prev;
+
+	assert(te);
+
+	prev = te_current;
+	te_current = te;
+
+	if (object)
+		te_gc_push(&te->gc.root, &te->gc.root_count, &te->gc.root_cap, object);
+
+	te_current = prev;
+}
+
+void te_gc_unroot(tiny_eval *te, te_object *object)
+{
+	int i;
+
+	assert(te);
+
+	for (i = te->gc.root_count - 1; i >= 0; i--)
+	{
+		if (te->gc.root[i] == object)
+		{
+			te->gc.root[i] = te->gc.root[--te->gc.root_count];
+			break;
+		}
+	}
+}
+
+static te_object te_nil = { TE_REF_IMMORTAL, TE_TYPE_NIL, NULL, { 0 } };
+static te_object te_true = { TE_REF_IMMORTAL, TE_TYPE_BOOLEAN, NULL, { 1 } };
+static te_object te_false = { TE_REF_IMMORTAL, TE_TYPE_BOOLEAN, NULL, { 0 } };
+
+/*
+ * Integers from TE_INTEGER_MIN up to TE_INTEGER_MAX are shared. The
+ * table is spelled out by doubling macros, 128 entries per row.
+ */
+#define TE_INTEGER_MIN (-128)
+#define TE_INTEGER_MAX 1023
+
+#define TE_INTEGER_1(n) { TE_REF_IMMORTAL, TE_TYPE_INTEGER, NULL, { (n) } },
+#define TE_INTEGER_2(n) TE_INTEGER_1(n) TE_INTEGER_1((n) + 1)
+#define TE_INTEGER_4(n) TE_INTEGER_2(n) TE_INTEGER_2((n) + 2)
+#define TE_INTEGER_8(n) TE_INTEGER_4(n) TE_INTEGER_4((n) + 4)
+#define TE_INTEGER_16(n) TE_INTEGER_8(n) TE_INTEGER_8((n) + 8)
+#define TE_INTEGER_32(n) TE_INTEGER_16(n) TE_INTEGER_16((n) + 16)
+#define TE_INTEGER_64(n) TE_INTEGER_32(n) TE_INTEGER_32((n) + 32)
+#define TE_INTEGER_128(n) TE_INTEGER_64(n) TE_INTEGER_64((n) + 64)
+
+static te_object te_integer[TE_INTEGER_MAX - TE_INTEGER_MIN + 1] =
+{
+	TE_INTEGER_128(-128)
+	TE_INTEGER_128(0)
+	TE_INTEGER_128(128)
+	TE_INTEGER_128(256)
+	TE_INTEGER_128(384)
+	TE_INTEGER_128(512)
+	TE_INTEGER_128(640)
+	TE_INTEGER_128(768)
+	TE_INTEGER_128(896)
+};
+
+#undef TE_INTEGER_128
+#undef TE_INTEGER_64
+#undef TE_INTEGER_32
+#undef TE_INTEGER_16
+#undef TE_INTEGER_8
+#undef TE_INTEGER_4
+#undef TE_INTEGER_2
+#undef TE_INTEGER_1
+
+te_object* te_make_nil(void)
+{
+	return &te_nil;
+}
+
+te_object* te_make_procedure(te_procedure proc, void *user)
+{
+	te_object *out;
+
+	assert(proc);
+
+	out = te_object_alloc();
+
+	out->type = TE_TYPE_PROCEDURE;
+	out->data.procedure = &((te_block*)out)->used.procedure;
+	out->data.procedure->proc = proc;
+	out->data.procedure->native = NULL;
+	out->data.procedure->user = user;
+
+	return out;
+}
+
+static te_object* te_make_native(te_native native, void *user)
+{
+	te_object *out;
+
+	assert(native);
+
+	out = te_object_alloc();
+
+	out->type = TE_TYPE_PROCEDURE;
+	out->data.procedure = &((te_block*)out)->used.procedure;
+	out->data.procedure->proc = NULL;
+	out->data.procedure->native = native;
+	out->data.procedure->user = user;
+
+	return out;
+}
+
+te_object* te_make_userdata(void *user)
+{
+	te_object *out;
+
+	out = te_object_alloc();
+
+	out->type = TE_TYPE_USERDATA;
+	out->data.userdata = user;
+
+	return out;
+}
+
+te_object* te_make_int64(te_int64 value)
+{
+	te_object *out;
+
+	if (value >= TE_INTEGER_MIN && value <= TE_INTEGER_MAX)
+		return &te_integer[value - TE_INTEGER_MIN];
+
+	out = te_object_alloc();
+
+	out->type = TE_TYPE_INTEGER;
+	out->data.int_value = value;
+
+	return out;
+}
+
+te_object* te_make_integer(long value)
+{
+	return te_make_int64(value);
+}
+
+te_object* te_make_number(double number)
+{
+	te_object *out;
+
+	out = te_object_alloc();
+
+	out->type = TE_TYPE_NUMBER;
+	out->data.num_value = number;
+
+	return out;
+}
+
+te_object* te_make_str(const char *str)
+{
+	return te_make_string(str, str + strlen(str));
+}
+
+te_object* te_make_string(const char *str, const char *end)
+{
+	size_t length;
+	te_object *out;
+
+	assert(str);
+	assert(end);
+
+	out = te_object_alloc();
+
+	length = end - str;
+	out->type = TE_TYPE_STRING;
+
+	if (out->ref == TE_REF_IMMORTAL)
+	{
+		out->data.str_value = te_region_alloc(te_current, length + 1);
+		memcpy(out->data.str_value, str, length);
+		out->data.str_value[length] = '\0';
+	}
+	else
+	{
+		out->data.str_value = te_str_extract(str, end);
+	}
+
+	return out;
+}
+
+te_object* te_make_boolean(int value)
+{
+	return value ? &te_true : &te_false;
+}
+
+te_object* te_make_true()
+{
+	return te_make_boolean(1);
+}
+
+te_object* te_make_false()
+{
+	return te_make_boolean(0);
+}
+
+/*
+ * Calls a host procedure from the evaluator, boxing the operands for
+ * it and unboxing what it returns.
+ */
+static te_value te_call_host(tiny_eval *te, te_proc_data *procedure, te_value operands[], int count)
+{
+	te_object **boxed;
+	te_object *result;
+	int i;
+
+	boxed = te_stack_alloc(te, sizeof(te_object*) * (count + 1));
+
+	for (i = 0; i < count; i++)
+		boxed[i] = te_value_to_object(operands[i]);
+
+	result = procedure->proc(te, procedure->user, boxed, count);
+
+	for (i = 0; i < count; te_object_release(boxed[i++]));
+	te_stack_free(te, boxed);
+
+	return te_value_take(result);
+}
+
+/* Calls a procedure object with operands already on the value stack. */
+static te_value te_apply(tiny_eval *te, te_object *procedure, te_value operands[], int count)
+{
+	te_proc_data *data = procedure->data.procedure;
+
+	if (data->native)
+		return data->native(te, data->user, operands, count);
+
+	return te_call_host(te, data, operands, count);
+}
+
+te_object* te_call(tiny_eval *te, te_object *procedure, te_object *operands[], int count)
+{
+	te_object *result = NULL;
+	te_proc_data *data;
+	tiny_eval *prev;
+
+	assert(procedure);
+
+	prev = te_current;
+	te_current = te;
+
+	if (te_object_type(procedure) == TE_TYPE_PROCEDURE)
+	{
+		data = procedure->data.procedure;
+
+		if (data->native)
+		{
+			te_value *value;
+			te_value out;
+			int i;
+
+			value = te_stack_alloc(te, sizeof(te_value) * (count + 1));
+
+			for (i = 0; i < count; i++)
+				value[i] = te_value_from_object(operands[i]);
+
+			out = data->native(te, data->user, value, count);
+			result = te_value_to_object(out);
+			te_value_release(out);
+
+			for (i = 0; i < count; te_value_release(value[i++]));
+			te_stack_free(te, value);
+		}
+		else
+		{
+			result = data->proc(te, data->user, operands, count);
+		}
+	}
+
+	te_current = prev;
+
+	return result;
+}
+
+void* te_to_userdata(te_object *object)
+{
+	void *user = NULL;
+
+	assert(object);
+
+	if (te_object_type(object) == TE_TYPE_USERDATA)
+	{
+		user = object->data.userdata;
+	}
+
+	return user;
+}
+
+te_int64 te_to_int64(te_object *object)
+{
+	te_int64 value = 0;
+
+	assert(object);
+
+	if (te_object_type(object) == TE_TYPE_INTEGER)
+	{
+		value = object->data.int_value;
+	}
+
+	return value;
+}
+
+/* Where long is 32 bits, integers beyond it are cut; te_to_int64 is exact. */
+long te_to_integer(te_object *object)
+{
+	return (long)te_to_int64(object);
+}
+
+double te_to_number(te_object *object)
+{
+	te_type type;
+	double number = 0;
+
+	assert(object);
+	type = te_object_type(object);
+
+	if (type == TE_TYPE_NUMBER)
+	{
+		number = object->data.num_value;
+	}
+	else if (type == TE_TYPE_INTEGER)
+	{
+		number = (double)object->data.int_value;
+	}
+
+	return number;
+}
+
+const char* te_to_string(te_object *object)
+{
+	const char *str = NULL;
+
+	assert(object);
+
+	if (te_object_type(object) == TE_TYPE_STRING)
+	{
+		str = object->data.str_value;
+	}
+
+	return str;
+}
+
+int te_to_boolean(te_object *object)
+{
+	int value = 0;
+	assert(object);
+
+	if (te_object_type(object) == TE_TYPE_BOOLEAN)
+		value = object->data.int_value;
+
+	return value;
+}
+
+/*
+ * Carves size bytes from the interpreter stack, moving on to the next
+ * block when the current one is full. Everything on it is freed in
+ * reverse order.
+ */
+static void* te_stack_alloc(tiny_eval *te, size_t size)
+{
+	te_stack_block *block = te->stack;
+	void *out;
+
+	size = (size + 7) & ~(size_t)7;
+
+	if (block->top + size > block->size)
+	{
+		if (!block->next || block->next->size < size)
+		{
+			te_stack_block *next = te_stack_block_init(size > TE_STACK_BLOCK ? size : TE_STACK_BLOCK);
+
+			next->prev = block;
+			next->next = block->next;
+
+			if (block->next)
+				block->next->prev = next;
+
+			block->next = next;
+		}
+
+		block = block->next;
+		block->top = 0;
+		te->stack = block;
+	}
+
+	out = (char*)(block + 1) + block->top;
+	block->top += size;
+
+	return out;
+}
+
+static void te_stack_free(tiny_eval *te, void *p)
+{
+	te_stack_block *block = te->stack;
+
+	assert((char*)p >= (char*)(block + 1) && (char*)p < (char*)(block + 1) + block->size);
+
+	block->top = (char*)p - (char*)(block + 1);
+
+	if (block->top == 0 && block->prev)
+		te->stack = block->prev;
+}
+
+static const char *te_keyword[TE_KEYWORD_COUNT] =
+{
+	"define", "lambda", "cond", "if", "and", "or", "else"
+};
+
+tiny_eval* te_init(void)
+{
+	return te_init_with_allocator(NULL, NULL, NULL);
+}
+
+/*
+ * Makes an interpreter taking its memory from alloc and release, or
+ * from malloc and free when they are NULL. Objects the host makes
+ * outside of the interpreter still come from malloc.
+ */
+tiny_eval* te_init_with_allocator(te_alloc_func alloc, te_free_func release, void *user)
+{
+	tiny_eval *te;
+	tiny_eval *prev;
+	te_pool *pool;
+	int i;
+
+	pool = te_pool_init(alloc, release, user);
+	te = te_memory_alloc(pool, sizeof(tiny_eval));
+	te->pool = pool;
+
+	prev = te_current;
+	te_current = te;
+
+	te->error = NULL;
+	te->names.slot = NULL;
+	te->names.count = 0;
+	te->names.cap = 0;
+	te->global.slot = NULL;
+	te->global.count = 0;
+	te->global.cap = 0;
+	te->env = NULL;
+	te->stack = te_stack_block_init(TE_STACK_BLOCK);
+	te->global_version = 1;
+	te->region.block = NULL;
+	te->region.final = NULL;
+	te->region.final_count = 0;
+	te->region.final_cap = 0;
+	te->region.active = 0;
+	memset(&te->gc, 0, sizeof(te_gc));
+	te->gc.threshold = TE_GC_THRESHOLD;
+	te->tail.operand = NULL;
+	te->tail.cap = 0;
+	te->scratch.value = NULL;
+	te->scratch.cap = 0;
+	te->calls.record = NULL;
+	te->calls.count = 0;
+	te->calls.cap = 0;
+	te->calls.nested = 0;
+	te->calls.limit = TE_MAX_DEPTH;
+	pool->owner = te;
+
+	for (i = 0; i < TE_KEYWORD_COUNT; i++)
+	{
+		te_name *keyword = te_intern(te, te_keyword[i], te_keyword[i] + strlen(te_keyword[i]));
+		assert(keyword->id == i);
+		UNUSED(keyword);
+	}
+
+	te_define(te, "#!unspecific", te_make_nil());
+	te_define(te, "#t", te_make_true());
+	te_define(te, "#f", te_make_false());
+	te_define(te, "+", te_make_native(te_plus, NULL));
+	te_define(te, "-", te_make_native(te_minus, NULL));
+	te_define(te, "*", te_make_native(te_multiplies, NULL));
+	te_define(te, "/", te_make_native(te_divides, NULL));
+	te_define(te, "=", te_make_native(te_equal, NULL));
+	te_define(te, "<", te_make_native(te_lesser, NULL));
+	te_define(te, "<=", te_make_native(te_lesser_equal, NULL));
+	te_define(te, ">", te_make_native(te_greater, NULL));
+	te_define(te, ">=", te_make_native(te_greater_equal, NULL));
+	te_define(te, "not", te_make_native(te_not, NULL));
+	te_define(te, "display", te_make_native(te_display, NULL));
+	te_define(te, "newline", te_make_native(te_newline, NULL));
+
+	te_current = prev;
+
+	return te;
+}
+
+void te_release(tiny_eval *te)
+{
+	te_pool *pool;
+	int i;
+
+	assert(te);
+
+	if (te->error)
+		te_free(te->error);
+
+	for (i = 0; i < te->global.cap; i++)
+	{
+		if (te->global.slot[i])
+		{
+			te_value_release(te->global.slot[i]->value);
+			te_free(te->global.slot[i]);
+		}
+	}
+
+	if (te->global.slot)
+		te_free(te->global.slot);
+
+	for (i = 0; i < te->names.cap; i++)
+	{
+		if (te->names.slot[i])
+			te_free(te->names.slot[i]);
+	}
+
+	if (te->names.slot)
+		te_free(te->names.slot);
+
+	while (te->stack->prev)
+		te->stack = te->stack->prev;
+
+	while (te->stack)
+	{
+		te_stack_block *next = te->stack->next;
+		te_free(te->stack);
+		te->stack = next;
+	}
+
+	te_region_reset(te);
+
+	if (te->region.block)
+		te_free(te->region.block);
+
+	if (te->region.final)
+		te_free(te->region.final);
+
+	te_gc_sweep(&te->gc);
+
+	if (te->gc.object)
+		te_free(te->gc.object);
+
+	if (te->gc.root)
+		te_free(te->gc.root);
+
+	if (te->gc.gray)
+		te_free(te->gc.gray);
+
+	if (te->tail.operand)
+		te_free(te->tail.operand);
+
+	if (te->scratch.value)
+		te_free(te->scratch.value);
+
+	if (te->calls.record)
+		te_free(te->calls.record);
+
+	pool = te->pool;
+	pool->owner = NULL;
+	te_free(te);
+	te_pool_release(pool);
+}
+
+static unsigned int te_name_hash(const char *begin, const char *end)
+{
+	unsigned int hash = 2166136261u;
+
+	for (; begin < end; begin++)
+		hash = (hash ^ (unsigned char)tolower((unsigned char)*begin)) * 16777619u;
+
+	return hash;
+}
+
+static void te_names_grow(te_names *names)
+{
+	te_name **slot = names->slot;
+	int cap = names->cap;
+	int i;
+
+	names->cap = cap ? cap * 2 : 256;
+	names->slot = te_alloc(sizeof(te_name*) * names->cap);
+	assert(names->slot);
+	memset(names->slot, 0, sizeof(te_name*) * names->cap);
+
+	for (i = 0; i < cap; i++)
+	{
+		if (slot[i])
+		{
+			unsigned int at = slot[i]->hash & (names->cap - 1);
+
+			for (; names->slot[at]; at = (at + 1) & (names->cap - 1));
+			names->slot[at] = slot[i];
+		}
+	}
+
+	if (slot)
+		te_free(slot);
+}
+
+/*
+ * Returns the interned name for [begin, end), adding it on first use.
+ * Lookup is case-insensitive; the stored name is folded to lower case.
+ */
+te_name* te_intern(tiny_eval *te, const char *begin, const char *end)
+{
+	te_names *names = &te->names;
+	size_t length = end - begin;
+	unsigned int hash;
+	unsigned int at;
+	te_name *name;
+	size_t i;
+
+	if ((names->count + 1) * 2 > names->cap)
+		te_names_grow(names);
+
+	hash = te_name_hash(begin, end);
+
+	for (at = hash & (names->cap - 1); names->slot[at]; at = (at + 1) & (names->cap - 1))
+	{
+		name = names->slot[at];
+
+		if (name->hash == hash && name->length == length &&
+			strncasecmp(name->name, begin, length) == 0)
+		{
+			return name;
+		}
+	}
+
+	name = te_alloc(sizeof(te_name) + length);
+	assert(name);
+
+	name->hash = hash;
+	name->id = names->count++;
+	name->length = length;
+
+	for (i = 0; i < length; i++)
+		name->name[i] = (char)tolower((unsigned char)begin[i]);
+
+	name->name[length] = '\0';
+	names->slot[at] = name;
+
+	return name;
+}
+
+void te_symbol_init(te_symbol *s, te_name *name, te_value value)
+{
+	assert(s);
+	assert(name);
+
+	s->name = name;
+	s->value = value;
+	s->column = 0;
+}
+
+static te_symbol** te_global_slot(te_globals *global, te_name *name)
+{
+	unsigned int mask = global->cap - 1;
+	unsigned int at = name->hash & mask;
+
+	while (global->slot[at] && global->slot[at]->name != name)
+		at = (at + 1) & mask;
+
+	return &global->slot[at];
+}
+
+static void te_global_grow(te_globals *global)
+{
+	te_symbol **slot = global->slot;
+	int cap = global->cap;
+	int i;
+
+	global->cap = cap ? cap * 2 : 64;
+	global->slot = te_alloc(sizeof(te_symbol*) * global->cap);
+	assert(global->slot);
+	memset(global->slot, 0, sizeof(te_symbol*) * global->cap);
+
+	for (i = 0; i < cap; i++)
+	{
+		if (slot[i])
+			*te_global_slot(global, slot[i]->name) = slot[i];
+	}
+
+	if (slot)
+		te_free(slot);
+}
+
+te_symbol* te_global_find(tiny_eval *te, te_name *name)
+{
+	assert(te);
+	assert(name);
+
+	if (te->global.count == 0)
+		return NULL;
+
+	return *te_global_slot(&te->global, name);
+}
+
+/*
+ * Returns the global cell for name, adding an unbound one if there is
+ * none yet. Compiled code holds on to the cell, so it must not move.
+ */
+te_symbol* te_global_cell(tiny_eval *te, te_name *name)
+{
+	te_globals *global = &te->global;
+	te_symbol **slot;
+
+	assert(name);
+
+	if ((global->count + 1) * 2 > global->cap)
+		te_global_grow(global);
+
+	slot = te_global_slot(global, name);
+
+	if (!*slot)
+	{
+		*slot = te_alloc(sizeof(te_symbol));
+		assert(*slot);
+
+		te_symbol_init(*slot, name, TE_VALUE_UNBOUND);
+		global->count++;
+	}
+
+	return *slot;
+}
+
+void te_global_define(tiny_eval *te, te_name *name, te_value value)
+{
+	te_symbol *s = te_global_cell(te, name);
+
+	te_value_release(s->value);
+	s->value = value;
+	te->global_version++;
+}
+
+void te_define(tiny_eval *te, const char *symbol, te_object *object)
+{
+	tiny_eval *prev;
+
+	assert(te);
+	assert(symbol);
+
+	prev = te_current;
+	te_current = te;
+	te_global_define(te, te_intern(te, symbol, symbol + strlen(symbol)), te_value_take(object));
+	te_current = prev;
+}
+
+te_node* te_node_init(int type)
+{
+	te_node *node;
+
+	node = te_alloc(sizeof(te_node));
+	assert(node);
+
+	node->type = type;
+	node->name = NULL;
+	node->object = NULL;
+	node->child = NULL;
+	node->child_count = 0;
+	node->child_cap = 0;
+	node->binding = NULL;
+	node->binding_count = 0;
+	node->optimized = NULL;
+	node->guard = NULL;
+	node->guard_count = 0;
+	node->temp = -1;
+
+	return node;
+}
+
+void te_node_release(te_node *node)
+{
+	int i;
+
+	if (node)
+	{
+		for (i = 0; i < node->child_count; te_node_release(node->child[i++]));
+
+		if (node->child)
+			te_free(node->child);
+
+		if (node->binding)
+			te_free(node->binding);
+
+		if (node->guard)
+			te_free(node->guard);
+
+		te_node_release(node->optimized);
+		te_object_release(node->object);
+		te_free(node);
+	}
+}
+
+void te_node_reserve(te_node *node, int count)
+{
+	assert(node);
+
+	if (node->child_count + count > node->child_cap)
+	{
+		node->child_cap = node->child_count + count;
+		node->child = te_realloc(node->child, sizeof(te_node*) * node->child_cap);
+		assert(node->child);
+	}
+}
+
+void te_node_append(te_node *node, te_node *child)
+{
+	assert(node);
+
+	if (node->child_count >= node->child_cap)
+		te_node_reserve(node, 8);
+
+	node->child[node->child_count++] = child;
+}
+
+/* Copies node and its sub-forms, leaving out any rewrite of them. */
+static te_node* te_node_copy(te_node *node)
+{
+	te_node *copy;
+	int i;
+
+	copy = te_node_init(node->type);
+	copy->name = node->name;
+	copy->object = te_object_retain(node->object);
+	copy->temp = node->temp;
+
+	te_node_reserve(copy, node->child_count);
+
+	for (i = 0; i < node->child_count; i++)
+		copy->child[copy->child_count++] = te_node_copy(node->child[i]);
+
+	if (node->binding_count > 0)
+	{
+		copy->binding = te_alloc(sizeof(te_name*) * node->binding_count);
+		assert(copy->binding);
+
+		memcpy(copy->binding, node->binding, sizeof(te_name*) * node->binding_count);
+		copy->binding_count = node->binding_count;
+	}
+
+	return copy;
+}
+
+/* Returns the keyword id of an atom token, or -1 for anything else. */
+static int te_token_keyword(tiny_eval *te, te_token *token)
+{
+	te_name *name;
+
+	if (token->type != TE_TOKEN_ATOM)
+		return -1;
+
+	name = te_intern(te, token->begin, token->end);
+	return name->id < TE_KEYWORD_COUNT ? name->id : -1;
+}
+
+static te_name* te_token_intern(tiny_eval *te, te_token *token)
+{
+	return te_intern(te, token->begin, token->end);
+}
+
+static void te_parse_operands(tiny_eval *te, te_lexer *lexer, te_node *node, int begin, int end)
+{
+	te_node_reserve(node, te_lexer_count(lexer, begin, end));
+
+	while (begin < end && !te_error(te))
+		te_node_append(node, parse(te, lexer, &begin));
+}
+
+static int te_parse_bindings(tiny_eval *te, te_lexer *lexer, te_node *node, int begin, int end, const char *error)
+{
+	int i;
+
+	if (begin < end)
+	{
+		node->binding = te_alloc(sizeof(te_name*) * (end - begin));
+		assert(node->binding);
+	}
+
+	for (i = begin; i < end; i++)
+	{
+		if (lexer->token[i].type != TE_TOKEN_ATOM)
+		{
+			te_set_error(te, error);
+			return 0;
+		}
+
+		node->binding[node->binding_count++] = te_token_intern(te, &lexer->token[i]);
+	}
+
+	return 1;
+}
+
+te_node* te_parse_define(tiny_eval *te, te_lexer *lexer, int begin, int end)
+{
+	te_token *token = &lexer->token[begin];
+	te_node *node;
+
+	if (token->type == TE_TOKEN_OPEN)
+	{
+		node = te_node_init(TE_NODE_PROCEDURE);
+
+		if (token[1].type != TE_TOKEN_ATOM || token->match + 1 >= end)
+		{
+			te_set_error(te, "define: unexpected end of procedure definition");
+		}
+		else
+		{
+			node->name = te_token_intern(te, &token[1]);
+
+			if (te_parse_bindings(te, lexer, node, begin + 2, token->match, "define: unexpected end of procedure definition"))
+				te_parse_operands(te, lexer, node, token->match + 1, end);
+		}
+	}
+	else
+	{
+		node = te_node_init(TE_NODE_DEFINE);
+
+		if (token->type != TE_TOKEN_ATOM || te_lexer_count(lexer, begin + 1, end) != 1)
+		{
+			te_set_error(te, "define: unexpected end of expression");
+		}
+		else
+		{
+			node->name = te_token_intern(te, token);
+			te_parse_operands(te, lexer, node, begin + 1, end);
+		}
+	}
+
+	return node;
+}
+
+te_node* te_parse_lambda(tiny_eval *te, te_lexer *lexer, int begin, int end)
+{
+	te_token *token = &lexer->token[begin];
+	te_node *node;
+
+	node = te_node_init(TE_NODE_LAMBDA);
+
+	if (token->type == TE_TOKEN_OPEN)
+	{
+		if (te_parse_bindings(te, lexer, node, begin + 1, token->match, "lambda: unexpected end of definition"))
+			te_parse_operands(te, lexer, node, token->match + 1, end);
+	}
+	else
+	{
+		te_set_error(te, "lambda: invalid expression");
+	}
+
+	return node;
+}
+
+te_node* te_parse_cond(tiny_eval *te, te_lexer *lexer, int begin, int end)
+{
+	te_node *node;
+
+	node = te_node_init(TE_NODE_COND);
+	te_node_reserve(node, te_lexer_count(lexer, begin, end));
+
+	while (begin < end && !te_error(te))
+	{
+		te_token *token = &lexer->token[begin];
+		te_node *clause;
+		int close;
+
+		if (token->type != TE_TOKEN_OPEN)
+		{
+			te_set_error(te, "cond: unexpected conditional expression");
+			break;
+		}
+
+		close = token->match;
+
+		if (te_token_keyword(te, &token[1]) == TE_KEYWORD_ELSE)
+		{
+			clause = te_node_init(TE_NODE_ELSE);
+			te_parse_operands(te, lexer, clause, begin + 2, close);
+		}
+		else if (token[1].type != TE_TOKEN_CLOSE)
+		{
+			clause = te_node_init(TE_NODE_CLAUSE);
+			te_parse_operands(te, lexer, clause, begin + 1, close);
+		}
+		else
+		{
+			clause = te_node_init(TE_NODE_CLAUSE);
+			te_set_error(te, "cond: can't eval condition");
+		}
+
+		te_node_append(node, clause);
+		begin = close + 1;
+	}
+
+	return node;
+}
+
+te_node* te_parse_if(tiny_eval *te, te_lexer *lexer, int begin, int end)
+{
+	te_node *node;
+
+	node = te_node_init(TE_NODE_IF);
+	te_parse_operands(te, lexer, node, begin, end);
+
+	if (!te_error(te) && (node->child_count < 2 || node->child_count > 3))
+		te_set_error(te, "if: unexpected end of expression");
+
+	return node;
+}
+
+te_node* te_parse_and(tiny_eval *te, te_lexer *lexer, int begin, int end)
+{
+	te_node *node;
+
+	node = te_node_init(TE_NODE_AND);
+	te_parse_operands(te, lexer, node, begin, end);
+
+	return node;
+}
+
+te_node* te_parse_or(tiny_eval *te, te_lexer *lexer, int begin, int end)
+{
+	te_node *node;
+
+	node = te_node_init(TE_NODE_OR);
+	te_parse_operands(te, lexer, node, begin, end);
+
+	return node;
+}
+
+te_node* te_parse_atom(tiny_eval *te, te_token *token)
+{
+	te_node *node;
+	size_t length = token->end - token->begin;
+	char ch = *token->begin;
+
+	if (isdigit((unsigned char)ch) || ch == '-' || ch == '+' || ch == '.')
+	{
+		char buffer[64];
+		char *field = buffer;
+		char *ep;
+
+		if (length >= sizeof(buffer))
+		{
+			field = te_alloc(length + 1);
+			assert(field);
+		}
+
+		memcpy(field, token->begin, length);
+		field[length] = '\0';
+		node = NULL;
+
+		if (memchr(field, '.', length))
+		{
+			double num = strtod(field, &ep);
+
+			if (!*ep)
+			{
+				node = te_node_init(TE_NODE_CONSTANT);
+				node->object = te_make_number(num);
+			}
+		}
+		else
+		{
+			te_int64 value = te_strtoi64(field, &ep, 10);
+
+			if (!*ep)
+			{
+				node = te_node_init(TE_NODE_CONSTANT);
+				node->object = te_make_int64(value);
+			}
+		}
+
+		if (field != buffer)
+			te_free(field);
+
+		if (node)
+			return node;
+	}
+
+	node = te_node_init(TE_NODE_SYMBOL);
+	node->name = te_token_intern(te, token);
+
+	return node;
+}
+
+te_node* te_parse_apply(tiny_eval *te, te_lexer *lexer, int begin, int end)
+{
+	te_token *head = &lexer->token[begin];
+	te_node *node;
+
+	node = te_node_init(TE_NODE_APPLY);
+	te_node_reserve(node, te_lexer_count(lexer, begin, end));
+
+	if (head->type == TE_TOKEN_OPEN)
+	{
+		te_node_append(node, parse(te, lexer, &begin));
+	}
+	else
+	{
+		te_node *op = te_node_init(TE_NODE_SYMBOL);
+		op->name = te_token_intern(te, head);
+		te_node_append(node, op);
+		begin++;
+	}
+
+	te_parse_operands(te, lexer, node, begin, end);
+	return node;
+}
+
+te_node* parse(tiny_eval *te, te_lexer *lexer, int *index)
+{
+	te_token *token = &lexer->token[*index];
+	te_node *node = NULL;
+
+	if (token->type == TE_TOKEN_OPEN)
+	{
+		te_token *head = &token[1];
+		int begin = *index + 2;
+		int end = token->match;
+
+		if (head->type == TE_TOKEN_CLOSE)
+		{
+			te_set_error(te, "eval: unexpected end of expression");
+		}
+		else
+		{
+			switch (te_token_keyword(te, head))
+			{
+			case TE_KEYWORD_DEFINE:
+				node = te_parse_define(te, lexer, begin, end);
+				break;
+
+			case TE_KEYWORD_LAMBDA:
+				node = te_parse_lambda(te, lexer, begin, end);
+				break;
+
+			case TE_KEYWORD_COND:
+				node = te_parse_cond(te, lexer, begin, end);
+				break;
+
+			case TE_KEYWORD_IF:
+				node = te_parse_if(te, lexer, begin, end);
+				break;
+
+			case TE_KEYWORD_AND:
+				node = te_parse_and(te, lexer, begin, end);
+				break;
+
+			case TE_KEYWORD_OR:
+				node = te_parse_or(te, lexer, begin, end);
+				break;
+
+			default:
+				node = te_parse_apply(te, lexer, *index + 1, end);
+				break;
+			}
+		}
+
+		*index = end + 1;
+	}
+	else if (token->type == TE_TOKEN_STRING)
+	{
+		node = te_node_init(TE_NODE_CONSTANT);
+		node->object = te_make_string(token->begin + 1, token->end - 1);
+		(*index)++;
+	}
+	else if (token->type == TE_TOKEN_ATOM)
+	{
+		node = te_parse_atom(te, token);
+		(*index)++;
+	}
+	else
+	{
+		te_set_error(te, "eval: unexpected close parenthesis");
+		(*index)++;
+	}
+
+	return node;
+}
+
+te_code* te_code_init(void)
+{
+	te_code *code;
+
+	code = te_alloc(sizeof(te_code));
+	assert(code);
+
+	code->op = NULL;
+	code->op_count = 0;
+	code->op_cap = 0;
+	code->constant = NULL;
+	code->constant_count = 0;
+	code->constant_cap = 0;
+	code->global = NULL;
+	code->global_count = 0;
+	code->global_cap = 0;
+	code->cache = NULL;
+	code->cache_count = 0;
+	code->cache_cap = 0;
+	code->lambda = NULL;
+	code->lambda_count = 0;
+	code->lambda_cap = 0;
+	code->depth = 0;
+	code->stack_size = 0;
+
+	return code;
+}
+
+void te_code_release(te_code *code)
+{
+	int i;
+
+	if (code)
+	{
+		for (i = 0; i < code->constant_count; te_value_release(code->constant[i++]));
+		for (i = 0; i < code->lambda_count; te_function_release(code->lambda[i++]));
+
+		if (code->op)
+			te_free(code->op);
+
+		if (code->constant)
+			te_free(code->constant);
+
+		if (code->global)
+			te_free(code->global);
+
+		if (code->cache)
+			te_free(code->cache);
+
+		if (code->lambda)
+			te_free(code->lambda);
+
+		te_free(code);
+	}
+}
+
+static int te_emit(te_code *code, int op)
+{
+	if (code->op_count >= code->op_cap)
+	{
+		code->op_cap = code->op_cap ? code->op_cap * 2 : 64;
+		code->op = te_realloc(code->op, sizeof(int) * code->op_cap);
+		assert(code->op);
+	}
+
+	code->op[code->op_count] = op;
+	return code->op_count++;
+}
+
+static void te_code_depth(te_code *code, int delta)
+{
+	code->depth += delta;
+	assert(code->depth >= 0);
+
+	if (code->depth > code->stack_size)
+		code->stack_size = code->depth;
+}
+
+static void te_emit_push(te_code *code, int op)
+{
+	te_emit(code, op);
+	te_code_depth(code, 1);
+}
+
+static void te_emit_pop(te_code *code, int op, int count)
+{
+	te_emit(code, op);
+	te_code_depth(code, -count);
+}
+
+static void te_emit_patch(te_code *code, int at)
+{
+	code->op[at] = code->op_count;
+}
+
+static int te_code_constant(te_code *code, te_object *object)
+{
+	if (code->constant_count >= code->constant_cap)
+	{
+		code->constant_cap = code->constant_cap ? code->constant_cap * 2 : 8;
+		code->constant = te_realloc(code->constant, sizeof(te_value) * code->constant_cap);
+		assert(code->constant);
+	}
+
+	code->constant[code->constant_count] = te_value_from_object(object);
+	return code->constant_count++;
+}
+
+static int te_code_global(te_code *code, te_symbol *s)
+{
+	int i;
+
+	for (i = 0; i < code->global_count; i++)
+	{
+		if (code->global[i] == s)
+			return i;
+	}
+
+	if (code->global_count >= code->global_cap)
+	{
+		code->global_cap = code->global_cap ? code->global_cap * 2 : 8;
+		code->global = te_realloc(code->global, sizeof(te_symbol*) * code->global_cap);
+		assert(code->global);
+	}
+
+	code->global[code->global_count] = s;
+	return code->global_count++;
+}
+
+static int te_code_cache(te_code *code, te_symbol *s)
+{
+	te_cache *cache;
+
+	if (code->cache_count >= code->cache_cap)
+	{
+		code->cache_cap = code->cache_cap ? code->cache_cap * 2 : 8;
+		code->cache = te_realloc(code->cache, sizeof(te_cache) * code->cache_cap);
+		assert(code->cache);
+	}
+
+	cache = &code->cache[code->cache_count];
+	cache->cell = s;
+	cache->version = 0;
+	cache->procedure = NULL;
+	cache->native = NULL;
+	cache->user = NULL;
+
+	return code->cache_count++;
+}
+
+static void te_scope_init(te_scope *scope, tiny_eval *te, te_code *code, te_scope *parent)
+{
+	scope->te = te;
+	scope->code = code;
+	scope->parent = parent;
+	scope->name = NULL;
+	scope->procedure = NULL;
+	scope->count = 0;
+	scope->cap = 0;
+	scope->local = parent != NULL;
+	scope->capture = 0;
+	scope->inlining = 0;
+}
+
+static void te_scope_release(te_scope *scope)
+{
+	if (scope->name)
+		te_free(scope->name);
+
+	if (scope->procedure)
+		te_free(scope->procedure);
+}
+
+/* Later slots shadow earlier ones, so a repeated parameter binds last. */
+static int te_scope_find(te_scope *scope, te_name *name)
+{
+	int i;
+
+	for (i = scope->count - 1; i >= 0; i--)
+	{
+		if (scope->name[i] == name)
+			return i;
+	}
+
+	return -1;
+}
+
+static int te_scope_push(te_scope *scope, te_name *name)
+{
+	if (scope->count >= scope->cap)
+	{
+		scope->cap = scope->cap ? scope->cap * 2 : 8;
+		scope->name = te_realloc(scope->name, sizeof(te_name*) * scope->cap);
+		scope->procedure = te_realloc(scope->procedure, sizeof(te_function*) * scope->cap);
+		assert(scope->name && scope->procedure);
+	}
+
+	scope->name[scope->count] = name;
+	scope->procedure[scope->count] = NULL;
+	return scope->count++;
+}
+
+static int te_scope_define(te_scope *scope, te_name *name)
+{
+	int slot = te_scope_find(scope, name);
+	return slot >= 0 ? slot : te_scope_push(scope, name);
+}
+
+/*
+ * Gives every name the body defines a slot before any of it is
+ * compiled, so references ahead of a definition, including those from
+ * nested lambdas, resolve to the frame instead of the global table.
+ * Named procedures are always global and lambdas have frames of their
+ * own, so neither is looked into.
+ */
+static void te_scope_declare(te_scope *scope, te_node *node)
+{
+	int i;
+
+	if (node->type == TE_NODE_LAMBDA || node->type == TE_NODE_PROCEDURE)
+		return;
+
+	if (node->type == TE_NODE_DEFINE)
+		te_scope_define(scope, node->name);
+
+	for (i = 0; i < node->child_count; i++)
+		te_scope_declare(scope, node->child[i]);
+}
+
+/*
+ * Finds the frame holding name, counting frames outwards from the
+ * current one. Returns the slot, or -1 when name is global.
+ */
+static int te_scope_resolve(te_scope *scope, te_name *name, int *depth)
+{
+	int slot;
+
+	for (*depth = 0; scope && scope->local; scope = scope->parent, (*depth)++)
+	{
+		slot = te_scope_find(scope, name);
+
+		if (slot >= 0)
+			return slot;
+	}
+
+	return -1;
+}
+
+/*
+ * The optimizer rewrites the forms of a body before they are compiled.
+ * Builtins are only relied on within pure forms, which call nothing but
+ * arithmetic, comparisons and not, so none can be redefined part way
+ * through one. Such a form is rewritten on a copy, and its code checks
+ * that the builtins it relied on are still bound before running the
+ * copy, falling back on the form as written when one is not. seen holds
+ * the calls whose values are available for reuse.
+ */
+typedef struct tag_te_optimizer
+{
+	te_scope *scope;
+	te_symbol **guard;
+	int guard_count;
+	int guard_cap;
+	te_node **seen;
+	int seen_count;
+	int seen_cap;
+	int temp_count;
+	int changed;
+}
+te_optimizer;
+
+static void te_optimizer_init(te_optimizer *opt, te_scope *scope)
+{
+	opt->scope = scope;
+	opt->guard = NULL;
+	opt->guard_count = 0;
+	opt->guard_cap = 0;
+	opt->seen = NULL;
+	opt->seen_count = 0;
+	opt->seen_cap = 0;
+	opt->temp_count = 0;
+	opt->changed = 0;
+}
+
+static void te_optimizer_release(te_optimizer *opt)
+{
+	if (opt->guard)
+		te_free(opt->guard);
+
+	if (opt->seen)
+		te_free(opt->seen);
+}
+
+/* Builtins that only compute from their operands. */
+static int te_native_pure(te_native native)
+{
+	return native == te_plus || native == te_minus || native == te_multiplies ||
+		native == te_divides || native == te_not || native == te_equal ||
+		native == te_lesser || native == te_lesser_equal ||
+		native == te_greater || native == te_greater_equal;
+}
+
+/* Builtins that check every operand is a number, as arithmetic does. */
+static int te_native_checks(te_native native)
+{
+	return native == te_plus || native == te_minus ||
+		native == te_multiplies || native == te_divides;
+}
+
+/* Returns the global cell of the pure builtin node calls, if it calls one. */
+static te_symbol* te_optimize_builtin(te_scope *scope, te_node *node)
+{
+	te_node *op = node->child[0];
+	te_symbol *cell;
+	int depth;
+
+	if (op->type != TE_NODE_SYMBOL || te_scope_resolve(scope, op->name, &depth) >= 0)
+		return NULL;
+
+	cell = te_global_find(scope->te, op->name);
+
+	if (!cell || te_value_type(cell->value) != TE_TYPE_PROCEDURE)
+		return NULL;
+
+	return te_native_pure(TE_VALUE_OBJECT(cell->value)->data.procedure->native) ? cell : NULL;
+}
+
+static te_native te_optimize_native(te_symbol *cell)
+{
+	return TE_VALUE_OBJECT(cell->value)->data.procedure->native;
+}
+
+static int te_optimize_pure(te_scope *scope, te_node *node)
+{
+	int i;
+
+	switch (node->type)
+	{
+	case TE_NODE_CONSTANT:
+	case TE_NODE_SYMBOL:
+		return 1;
+
+	case TE_NODE_APPLY:
+		if (!te_optimize_builtin(scope, node))
+			return 0;
+
+		for (i = 1; i < node->child_count; i++)
+		{
+			if (!te_optimize_pure(scope, node->child[i]))
+				return 0;
+		}
+
+		return 1;
+
+	case TE_NODE_COND:
+	case TE_NODE_CLAUSE:
+	case TE_NODE_ELSE:
+	case TE_NODE_IF:
+	case TE_NODE_AND:
+	case TE_NODE_OR:
+		for (i = 0; i < node->child_count; i++)
+		{
+			if (!te_optimize_pure(scope, node->child[i]))
+				return 0;
+		}
+
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+static void te_optimize_guard(te_optimizer *opt, te_symbol *cell)
+{
+	int i;
+
+	for (i = 0; i < opt->guard_count; i++)
+	{
+		if (opt->guard[i] == cell)
+			return;
+	}
+
+	if (opt->guard_count >= opt->guard_cap)
+	{
+		opt->guard_cap = opt->guard_cap ? opt->guard_cap * 2 : 4;
+		opt->guard = te_realloc(opt->guard, sizeof(te_symbol*) * opt->guard_cap);
+		assert(opt->guard);
+	}
+
+	opt->guard[opt->guard_count++] = cell;
+}
+
+/* Returns 1 or 0 for a constant boolean, and -1 for any other form. */
+static int te_optimize_boolean(te_node *node)
+{
+	if (node->type != TE_NODE_CONSTANT || te_object_type(node->object) != TE_TYPE_BOOLEAN)
+		return -1;
+
+	return te_to_boolean(node->object);
+}
+
+static int te_optimize_integer(te_node *node, te_int64 integer)
+{
+	te_value value;
+	int same;
+
+	if (node->type != TE_NODE_CONSTANT)
+		return 0;
+
+	value = te_value_from_object(node->object);
+	same = te_value_type(value) == TE_TYPE_INTEGER && te_value_integer(value) == integer;
+	te_value_release(value);
+
+	return same;
+}
+
+/* Whether node always has a number for its value, or raises an error. */
+static int te_optimize_numeric(te_optimizer *opt, te_node *node)
+{
+	te_symbol *cell;
+	te_type type;
+
+	if (node->type == TE_NODE_CONSTANT)
+	{
+		type = te_object_type(node->object);
+		return type == TE_TYPE_NUMBER || type == TE_TYPE_INTEGER;
+	}
+
+	return node->type == TE_NODE_APPLY && (cell = te_optimize_builtin(opt->scope, node)) &&
+		te_native_checks(te_optimize_native(cell));
+}
+
+/* Replaces node with a sub-form of its own, which it lets go of. */
+static te_node* te_optimize_take(te_optimizer *opt, te_node *node, int index)
+{
+	te_node *child = node->child[index];
+
+	node->child[index] = NULL;
+	te_node_release(node);
+	opt->changed = 1;
+
+	return child;
+}
+
+static te_node* te_optimize_constant(te_optimizer *opt, te_node *node, te_object *object)
+{
+	te_node *constant = te_node_init(TE_NODE_CONSTANT);
+
+	constant->object = object;
+	te_node_release(node);
+	opt->changed = 1;
+
+	return constant;
+}
+
+/*
+ * Calls native on the constant operands of node from first to end, as
+ * the code would. Returns the result, or NULL if the call failed and so
+ * has to be left for the code to make.
+ */
+static te_object* te_optimize_call(te_optimizer *opt, te_native native, te_node *node, int first, int end)
+{
+	tiny_eval *te = opt->scope->te;
+	te_object *object = NULL;
+	te_value *operand;
+	te_value result;
+	int i;
+
+	operand = te_alloc(sizeof(te_value) * (end - first + 1));
+	assert(operand);
+
+	for (i = first; i < end; i++)
+		operand[i - first] = te_value_from_object(node->child[i]->object);
+
+	result = native(te, NULL, operand, end - first);
+
+	if (te_error(te))
+		te_set_error(te, NULL);
+	else
+		object = te_value_to_object(result);
+
+	te_value_release(result);
+
+	for (i = first; i < end; i++)
+		te_value_release(operand[i - first]);
+
+	te_free(operand);
+	return object;
+}
+
+/*
+ * Whether the 0s added by a call to + can be dropped. Adding 0 turns
+ * -0.0 into 0, which makes no difference only once an integer other
+ * than 0 is added, as nothing is then -0.0.
+ */
+static int te_optimize_zeros(te_node *node)
+{
+	te_value value;
+	int exact = 0;
+	int i;
+
+	for (i = 1; i < node->child_count && !exact; i++)
+	{
+		if (node->child[i]->type != TE_NODE_CONSTANT || te_optimize_integer(node->child[i], 0))
+			continue;
+
+		value = te_value_from_object(node->child[i]->object);
+		exact = te_value_type(value) == TE_TYPE_INTEGER;
+		te_value_release(value);
+	}
+
+	return exact;
+}
+
+/*
+ * Folds a builtin call whose operands are constants, and a run of
+ * constants leading the operands of +, - and *, which the code would
+ * fold first anyway. Operands that cannot change the result are
+ * dropped: the 1s multiplied by *, the 0s subtracted by -, and the 0s
+ * added by + where te_optimize_zeros allows. What is left of a call
+ * is replaced by its single operand when that is a number, or when
+ * checked says the caller checks it is one, as the call would.
+ */
+static te_node* te_optimize_apply(te_optimizer *opt, te_node *node, te_native native, int checked)
+{
+	te_object *object;
+	te_int64 identity = native == te_multiplies;
+	int drop;
+	int first;
+	int i;
+	int n;
+
+	for (i = 1; i < node->child_count && node->child[i]->type == TE_NODE_CONSTANT; i++);
+
+	if (i == node->child_count && (object = te_optimize_call(opt, native, node, 1, i)) != NULL)
+		return te_optimize_constant(opt, node, object);
+
+	if (native != te_plus && native != te_minus && native != te_multiplies)
+		return node;
+
+	if (i > 2 && (object = te_optimize_call(opt, native, node, 1, i)) != NULL)
+	{
+		for (n = 1; n < i; te_node_release(node->child[n++]));
+
+		node->child[1] = te_node_init(TE_NODE_CONSTANT);
+		node->child[1]->object = object;
+		memmove(node->child + 2, node->child + i, sizeof(te_node*) * (node->child_count - i));
+		node->child_count -= i - 2;
+		opt->changed = 1;
+	}
+
+	first = native == te_minus ? 2 : 1;
+
+	if (node->child_count <= first)
+		return node;
+
+	drop = native != te_plus || te_optimize_zeros(node);
+
+	for (i = n = first; i < node->child_count; i++)
+	{
+		if (drop && te_optimize_integer(node->child[i], identity) && (native != te_minus ||
+			checked || n > first || i < node->child_count - 1 || te_optimize_numeric(opt, node->child[1])))
+		{
+			te_node_release(node->child[i]);
+			opt->changed = 1;
+		}
+		else
+		{
+			node->child[n++] = node->child[i];
+		}
+	}
+
+	node->child_count = n;
+
+	if (n == 2 && (checked || te_optimize_numeric(opt, node->child[1])))
+		return te_optimize_take(opt, node, 1);
+
+	return node;
+}
+
+/* Settles an if whose test is a constant, unless it would fall off. */
+static te_node* te_optimize_if(te_optimizer *opt, te_node *node)
+{
+	int value = te_optimize_boolean(node->child[0]);
+
+	if (value < 0 || (!value && node->child_count < 3))
+		return node;
+
+	return te_optimize_take(opt, node, value ? 1 : 2);
+}
+
+/*
+ * Drops the constant operands of and and or that let evaluation go on,
+ * and the operands after one that stops it. Operands that are not
+ * constant keep their order and their check for a boolean.
+ */
+static te_node* te_optimize_logic(te_optimizer *opt, te_node *node)
+{
+	int stop = node->type == TE_NODE_OR;
+	int value;
+	int i;
+	int n;
+
+	for (i = n = 0; i < node->child_count; i++)
+	{
+		value = te_optimize_boolean(node->child[i]);
+
+		if (value == !stop)
+		{
+			te_node_release(node->child[i]);
+			opt->changed = 1;
+			continue;
+		}
+
+		node->child[n++] = node->child[i];
+
+		if (value == stop)
+		{
+			for (i++; i < node->child_count; te_node_release(node->child[i++]))
+				opt->changed = 1;
+			break;
+		}
+	}
+
+	node->child_count = n;
+
+	if (n == 0)
+		return te_optimize_constant(opt, node, te_make_boolean(!stop));
+
+	if (n == 1 && te_optimize_boolean(node->child[0]) == stop)
+		return te_optimize_take(opt, node, 0);
+
+	return node;
+}
+
+/*
+ * Drops the clauses of a cond whose tests are constantly false, and the
+ * ones after a test that is constantly true, which becomes an else. A
+ * cond left with an else of one form is replaced by that form.
+ */
+static te_node* te_optimize_cond(te_optimizer *opt, te_node *node)
+{
+	te_node *clause;
+	int value;
+	int i;
+	int n;
+
+	for (i = n = 0; i < node->child_count; i++)
+	{
+		clause = node->child[i];
+		value = clause->type == TE_NODE_CLAUSE ? te_optimize_boolean(clause->child[0]) : -1;
+
+		if (value == 0)
+		{
+			te_node_release(clause);
+			opt->changed = 1;
+			continue;
+		}
+
+		if (value == 1)
+		{
+			te_node_release(clause->child[0]);
+			memmove(clause->child, clause->child + 1, sizeof(te_node*) * --clause->child_count);
+			clause->type = TE_NODE_ELSE;
+			opt->changed = 1;
+		}
+
+		node->child[n++] = clause;
+
+		if (clause->type == TE_NODE_ELSE)
+		{
+			for (i++; i < node->child_count; te_node_release(node->child[i++]))
+				opt->changed = 1;
+			break;
+		}
+	}
+
+	node->child_count = n;
+
+	if (n == 1 && node->child[0]->type == TE_NODE_ELSE && node->child[0]->child_count == 1)
+	{
+		clause = te_optimize_take(opt, node, 0);
+		node = te_optimize_take(opt, clause, 0);
+	}
+
+	return node;
+}
+
+/*
+ * Folds a pure form bottom up. checked is set when the form is an
+ * operand of arithmetic, which checks its value is a number.
+ */
+static te_node* te_optimize_fold(te_optimizer *opt, te_node *node, int checked)
+{
+	te_symbol *cell;
+	te_native native;
+	int i;
+
+	switch (node->type)
+	{
+	case TE_NODE_APPLY:
+		cell = te_optimize_builtin(opt->scope, node);
+		native = te_optimize_native(cell);
+		te_optimize_guard(opt, cell);
+
+		for (i = 1; i < node->child_count; i++)
+			node->child[i] = te_optimize_fold(opt, node->child[i], te_native_checks(native));
+
+		return te_optimize_apply(opt, node, native, checked);
+
+	case TE_NODE_COND:
+	case TE_NODE_CLAUSE:
+	case TE_NODE_ELSE:
+	case TE_NODE_IF:
+	case TE_NODE_AND:
+	case TE_NODE_OR:
+		for (i = 0; i < node->child_count; i++)
+			node->child[i] = te_optimize_fold(opt, node->child[i], 0);
+
+		if (node->type == TE_NODE_COND)
+			return te_optimize_cond(opt, node);
+
+		if (node->type == TE_NODE_IF)
+			return te_optimize_if(opt, node);
+
+		if (node->type == TE_NODE_AND || node->type == TE_NODE_OR)
+			return te_optimize_logic(opt, node);
+
+		return node;
+
+	default:
+		return node;
+	}
+}
+
+/* Whether two pure forms always have the same value. */
+static int te_optimize_same(te_node *one, te_node *two)
+{
+	te_value a;
+	te_value b;
+	int i;
+
+	if (one->type == TE_NODE_TEMP || two->type == TE_NODE_TEMP)
+		return one->temp >= 0 && one->temp == two->temp;
+
+	if (one->type != two->type || one->name != two->name || one->child_count != two->child_count)
+		return 0;
+
+	if (one->type == TE_NODE_CONSTANT)
+	{
+		a = te_value_from_object(one->object);
+		b = te_value_from_object(two->object);
+		te_value_release(a);
+		te_value_release(b);
+
+		if (a != b)
+			return 0;
+	}
+
+	for (i = 0; i < one->child_count; i++)
+	{
+		if (!te_optimize_same(one->child[i], two->child[i]))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Replaces a call made again with a read of the value it had the first
+ * time, which saves it to a temp. Forms are walked in the order they
+ * run, and a value is only reused where the first call always ran: the
+ * calls seen in a branch are forgotten once it is left.
+ */
+static te_node* te_optimize_share(te_optimizer *opt, te_node *node)
+{
+	te_node *seen;
+	int after;
+	int mark;
+	int i;
+
+	switch (node->type)
+	{
+	case TE_NODE_APPLY:
+		for (i = 1; i < node->child_count; i++)
+			node->child[i] = te_optimize_share(opt, node->child[i]);
+
+		for (i = 0; i < opt->seen_count; i++)
+		{
+			seen = opt->seen[i];
+
+			if (te_optimize_same(seen, node))
+			{
+				if (seen->temp < 0)
+					seen->temp = opt->temp_count++;
+
+				te_node_release(node);
+				node = te_node_init(TE_NODE_TEMP);
+				node->temp = seen->temp;
+				opt->changed = 1;
+
+				return node;
+			}
+		}
+
+		if (opt->seen_count >= opt->seen_cap)
+		{
+			opt->seen_cap = opt->seen_cap ? opt->seen_cap * 2 : 16;
+			opt->seen = te_realloc(opt->seen, sizeof(te_node*) * opt->seen_cap);
+			assert(opt->seen);
+		}
+
+		opt->seen[opt->seen_count++] = node;
+		return node;
+
+	case TE_NODE_IF:
+	case TE_NODE_AND:
+	case TE_NODE_OR:
+		node->child[0] = te_optimize_share(opt, node->child[0]);
+		mark = opt->seen_count;
+
+		for (i = 1; i < node->child_count; i++)
+		{
+			node->child[i] = te_optimize_share(opt, node->child[i]);
+
+			if (node->type == TE_NODE_IF)
+				opt->seen_count = mark;
+		}
+
+		opt->seen_count = mark;
+		return node;
+
+	case TE_NODE_COND:
+		after = opt->seen_count;
+
+		for (i = 0; i < node->child_count; i++)
+		{
+			te_node *clause = node->child[i];
+			int first = clause->type == TE_NODE_CLAUSE;
+			int j;
+
+			if (first)
+				clause->child[0] = te_optimize_share(opt, clause->child[0]);
+
+			if (i == 0)
+				after = opt->seen_count;
+
+			mark = opt->seen_count;
+
+			for (j = first; j < clause->child_count; j++)
+				clause->child[j] = te_optimize_share(opt, clause->child[j]);
+
+			opt->seen_count = mark;
+		}
+
+		opt->seen_count = after;
+		return node;
+
+	default:
+		return node;
+	}
+}
+
+/*
+ * Rewrites a pure form on a copy, which node keeps if anything came of
+ * it. body is the optimizer of the body node belongs to, which counts
+ * the temps its code has to set aside.
+ */
+static void te_optimize_form(te_optimizer *body, te_node *node)
+{
+	tiny_eval *te = body->scope->te;
+	te_optimizer opt;
+	te_node *copy;
+	int enabled;
+
+	te_optimizer_init(&opt, body->scope);
+
+	/* What folding makes belongs to the code, as constants do. */
+	enabled = te->gc.enabled;
+	te->gc.enabled = 0;
+
+	copy = te_optimize_fold(&opt, te_node_copy(node), 0);
+	copy = te_optimize_share(&opt, copy);
+
+	te->gc.enabled = enabled;
+
+	if (opt.changed)
+	{
+		node->optimized = copy;
+		node->guard = opt.guard;
+		node->guard_count = opt.guard_count;
+		opt.guard = NULL;
+
+		if (opt.temp_count > body->temp_count)
+			body->temp_count = opt.temp_count;
+	}
+	else
+	{
+		te_node_release(copy);
+	}
+
+	te_optimizer_release(&opt);
+}
+
+/*
+ * Finds the largest pure forms in node and rewrites them. Forms around
+ * those are left as written. Lambdas are optimized with their own
+ * bodies.
+ */
+static void te_optimize_walk(te_optimizer *body, te_node *node)
+{
+	int i;
+
+	switch (node->type)
+	{
+	case TE_NODE_CONSTANT:
+	case TE_NODE_SYMBOL:
+	case TE_NODE_PROCEDURE:
+	case TE_NODE_LAMBDA:
+		return;
+
+	case TE_NODE_APPLY:
+	case TE_NODE_COND:
+	case TE_NODE_IF:
+	case TE_NODE_AND:
+	case TE_NODE_OR:
+		if (te_optimize_pure(body->scope, node))
+		{
+			te_optimize_form(body, node);
+			return;
+		}
+		break;
+	}
+
+	for (i = 0; i < node->child_count; i++)
+		te_optimize_walk(body, node->child[i]);
+}
+
+/*
+ * Optimizes the forms of a body compiled in scope. Returns the number
+ * of temps its code keeps at the bottom of its value stack.
+ */
+static int te_optimize_body(te_scope *scope, te_node *node)
+{
+	te_optimizer body;
+	int i;
+
+	te_optimizer_init(&body, scope);
+
+	for (i = 0; i < node->child_count; i++)
+		te_optimize_walk(&body, node->child[i]);
+
+	te_optimizer_release(&body);
+	return body.temp_count;
+}
+
+static void te_emit_symbol(te_scope *scope, te_name *name)
+{
+	te_code *code = scope->code;
+	int depth;
+	int slot;
+
+	slot = te_scope_resolve(scope, name, &depth);
+
+	if (slot >= 0)
+	{
+		te_emit_push(code, TE_OP_LOCAL);
+		te_emit(code, depth);
+		te_emit(code, slot);
+	}
+	else
+	{
+		te_emit_push(code, TE_OP_GLOBAL);
+		te_emit(code, te_code_global(code, te_global_cell(scope->te, name)));
+	}
+}
+
+static void te_emit_node(te_scope *scope, te_node *node, int tail);
+static void te_emit_sequence(te_scope *scope, te_node *node, int first, int tail);
+
+/* Sets aside the temps at the bottom of the value stack, as nils. */
+static void te_emit_temps(te_code *code, int count)
+{
+	for (; count > 0; count--)
+		te_emit_push(code, TE_OP_NIL);
+}
+
+/*
+ * Calls to a lambda of one small form may be inlined: its operands are
+ * left on the value stack, where the form reads its parameters from,
+ * and the call is only made if the binding was redefined since. Other
+ * names in the form have to be global, so it needs no frame.
+ */
+#define TE_INLINE_SIZE  16
+#define TE_INLINE_DEPTH 4
+
+/* Returns the parameter of lambda that name binds to, or -1. */
+static int te_inline_parameter(te_node *lambda, te_name *name)
+{
+	int i;
+
+	for (i = lambda->binding_count - 1; i >= 0; i--)
+	{
+		if (lambda->binding[i] == name)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Counts the nodes of a form that can be inlined into scope, taking
+ * away from size, or returns -1 if it cannot be. callee is the name of
+ * the lambda, which the form must not call again.
+ */
+static int te_inline_size(te_scope *scope, te_node *lambda, te_node *node, te_name *callee, int size)
+{
+	int depth;
+	int i;
+
+	if (--size < 0)
+		return -1;
+
+	switch (node->type)
+	{
+	case TE_NODE_SYMBOL:
+		if (te_inline_parameter(lambda, node->name) < 0 &&
+			(node->name == callee || te_scope_resolve(scope, node->name, &depth) >= 0))
+			return -1;
+		break;
+
+	case TE_NODE_CONSTANT:
+	case TE_NODE_COND:
+	case TE_NODE_CLAUSE:
+	case TE_NODE_ELSE:
+	case TE_NODE_IF:
+	case TE_NODE_AND:
+	case TE_NODE_OR:
+	case TE_NODE_APPLY:
+		break;
+
+	default:
+		return -1;
+	}
+
+	for (i = 0; i < node->child_count && size >= 0; i++)
+		size = te_inline_size(scope, lambda, node->child[i], callee, size);
+
+	return size;
+}
+
+/* Whether calls to the lambda node compiles in parent could be inlined. */
+static int te_inline_candidate(te_scope *parent, te_node *node)
+{
+	return node->child_count == 1 &&
+		te_inline_size(parent, node, node->child[0], node->name, TE_INLINE_SIZE) >= 0;
+}
+
+/*
+ * Returns the function a call to the name op in scope is expected to
+ * run, if it can be inlined there. slot and depth are where op resolved.
+ */
+static te_function* te_inline_callee(te_scope *scope, te_name *op, int slot, int depth, int count)
+{
+	te_function *function = NULL;
+	te_symbol *cell;
+
+	if (scope->inlining >= TE_INLINE_DEPTH)
+		return NULL;
+
+	if (slot >= 0)
+	{
+		for (; depth > 0; depth--)
+			scope = scope->parent;
+
+		function = scope->procedure[slot];
+	}
+	else
+	{
+		te_scope *root;
+
+		for (root = scope; root->local; root = root->parent);
+
+		if ((slot = te_scope_find(root, op)) >= 0)
+			function = root->procedure[slot];
+		else if ((cell = te_global_find(scope->te, op)))
+			function = te_lambda_function(cell->value);
+	}
+
+	if (!function || !function->body || function->binding_count != count ||
+		te_inline_size(scope, function->body, function->body->child[0], op, TE_INLINE_SIZE) < 0)
+		return NULL;
+
+	return function;
+}
+
+/* Copies the form of lambda with its parameters read from base on. */
+static te_node* te_inline_form(te_node *lambda, te_node *node, int base)
+{
+	te_node *copy;
+	int i;
+
+	if (node->type == TE_NODE_SYMBOL && (i = te_inline_parameter(lambda, node->name)) >= 0)
+	{
+		copy = te_node_init(TE_NODE_TEMP);
+		copy->temp = base + i;
+		return copy;
+	}
+
+	copy = te_node_init(node->type);
+	copy->name = node->name;
+	copy->object = te_object_retain(node->object);
+
+	te_node_reserve(copy, node->child_count);
+
+	for (i = 0; i < node->child_count; i++)
+		copy->child[copy->child_count++] = te_inline_form(lambda, node->child[i], base);
+
+	return copy;
+}
+
+te_function* te_function_init(te_scope *parent, te_node *node)
+{
+	te_function *function;
+	te_scope scope;
+	int i;
+
+	function = te_alloc(sizeof(te_function));
+	assert(function);
+
+	function->ref = 1;
+	function->name = node->name;
+	function->binding_count = node->binding_count;
+	function->code = te_code_init();
+	function->jit = NULL;
+	function->calls = 0;
+	function->body = te_inline_candidate(parent, node) ? te_node_copy(node) : NULL;
+
+	te_scope_init(&scope, parent->te, function->code, parent);
+
+	for (i = 0; i < node->binding_count; i++)
+		te_scope_push(&scope, node->binding[i]);
+
+	for (i = 0; i < node->child_count; i++)
+		te_scope_declare(&scope, node->child[i]);
+
+	te_emit_temps(function->code, te_optimize_body(&scope, node));
+	te_emit_sequence(&scope, node, 0, 1);
+	te_emit_pop(function->code, TE_OP_RETURN, 1);
+
+	function->slot_count = scope.count;
+	function->capture = scope.capture;
+	te_scope_release(&scope);
+
+	return function;
+}
+
+void te_function_release(te_function *function)
+{
+	if (function && --function->ref <= 0)
+	{
+		te_jit_release(function->jit);
+		te_code_release(function->code);
+		te_node_release(function->body);
+		te_free(function);
+	}
+}
+
+/* Adds a function for the code to make lambdas of, or to check for. */
+static int te_code_function(te_code *code, te_function *function)
+{
+	if (code->lambda_count >= code->lambda_cap)
+	{
+		code->lambda_cap = code->lambda_cap ? code->lambda_cap * 2 : 8;
+		code->lambda = te_realloc(code->lambda, sizeof(te_function*) * code->lambda_cap);
+		assert(code->lambda);
+	}
+
+	code->lambda[code->lambda_count] = function;
+	return code->lambda_count++;
+}
+
+static int te_code_lambda(te_scope *scope, te_node *node)
+{
+	scope->capture = 1;
+	return te_code_function(scope->code, te_function_init(scope, node));
+}
+
+/*
+ * A form in tail position is the last thing a lambda body evaluates.
+ * Calls there are emitted as TAIL_CALL ops, and compound forms pass the
+ * position on to the forms whose value they take as their own.
+ */
+static void te_emit_sequence(te_scope *scope, te_node *node, int first, int tail)
+{
+	te_code *code = scope->code;
+	int i;
+
+	if (first >= node->child_count)
+	{
+		te_emit_push(code, TE_OP_NIL);
+	}
+
+	for (i = first; i < node->child_count; i++)
+	{
+		if (i > first)
+			te_emit_pop(code, TE_OP_POP, 1);
+
+		te_emit_node(scope, node->child[i], tail && i == node->child_count - 1);
+	}
+}
+
+static int te_emit_branch(te_code *code, int op, int message)
+{
+	int at;
+
+	te_emit_pop(code, op, 1);
+	at = te_emit(code, 0);
+	te_emit(code, message);
+
+	return at;
+}
+
+static int te_emit_jump(te_code *code)
+{
+	te_emit(code, TE_OP_JUMP);
+	return te_emit(code, 0);
+}
+
+/*
+ * Named procedures always land in the global table. Other definitions
+ * bind in the frame of the lambda they appear in, or globally at the
+ * top level. Either way the scope notes the lambda a name is bound to,
+ * for calls compiled after to inline.
+ */
+static void te_emit_define(te_scope *scope, te_node *node)
+{
+	te_code *code = scope->code;
+	te_function *function;
+	int lambda;
+	int slot;
+
+	if (node->type == TE_NODE_PROCEDURE)
+	{
+		lambda = te_code_lambda(scope, node);
+
+		te_emit_push(code, TE_OP_LAMBDA);
+		te_emit(code, lambda);
+		te_emit(code, TE_OP_DEFINE_GLOBAL);
+		te_emit(code, te_code_global(code, te_global_cell(scope->te, node->name)));
+
+		for (; scope->local; scope = scope->parent);
+		slot = te_scope_define(scope, node->name);
+		scope->procedure[slot] = code->lambda[lambda];
+	}
+	else
+	{
+		te_emit_node(scope, node->child[0], 0);
+		function = node->child[0]->type == TE_NODE_LAMBDA ? code->lambda[code->lambda_count - 1] : NULL;
+		slot = te_scope_define(scope, node->name);
+		scope->procedure[slot] = function;
+
+		if (scope->local)
+		{
+			te_emit(code, TE_OP_DEFINE_LOCAL);
+			te_emit(code, slot);
+		}
+		else
+		{
+			te_emit(code, TE_OP_DEFINE_GLOBAL);
+			te_emit(code, te_code_global(code, te_global_cell(scope->te, node->name)));
+		}
+	}
+}
+
+static void te_emit_cond(te_scope *scope, te_node *node, int tail)
+{
+	te_code *code = scope->code;
+	int *done;
+	int done_count = 0;
+	int i;
+
+	done = te_alloc(sizeof(int) * (node->child_count + 1));
+	assert(done);
+
+	for (i = 0; i < node->child_count; i++)
+	{
+		te_node *clause = node->child[i];
+
+		if (clause->type == TE_NODE_ELSE)
+		{
+			te_emit_sequence(scope, clause, 0, tail);
+			te_code_depth(code, -1);
+			done[done_count++] = te_emit_jump(code);
+			break;
+		}
+		else
+		{
+			int next;
+
+			te_emit_node(scope, clause->child[0], 0);
+			next = te_emit_branch(code, TE_OP_JUMP_FALSE, TE_MSG_COND_RESULT);
+
+			te_emit_sequence(scope, clause, 1, tail);
+			te_code_depth(code, -1);
+			done[done_count++] = te_emit_jump(code);
+
+			te_emit_patch(code, next);
+		}
+	}
+
+	if (i == node->child_count)
+		te_emit_push(code, TE_OP_NIL);
+	else
+		te_code_depth(code, 1);
+
+	for (i = 0; i < done_count; te_emit_patch(code, done[i++]));
+	te_free(done);
+}
+
+static void te_emit_if(te_scope *scope, te_node *node, int tail)
+{
+	te_code *code = scope->code;
+	int alternative;
+	int done;
+
+	te_emit_node(scope, node->child[0], 0);
+	alternative = te_emit_branch(code, TE_OP_JUMP_FALSE, TE_MSG_IF_RESULT);
+
+	te_emit_node(scope, node->child[1], tail);
+	te_code_depth(code, -1);
+	done = te_emit_jump(code);
+
+	te_emit_patch(code, alternative);
+
+	if (node->child_count > 2)
+	{
+		te_emit_node(scope, node->child[2], tail);
+	}
+	else
+	{
+		te_emit(code, TE_OP_ERROR);
+		te_emit(code, TE_MSG_IF_END);
+		te_code_depth(code, 1);
+	}
+
+	te_emit_patch(code, done);
+}
+
+static void te_emit_logic(te_scope *scope, te_node *node, int op, int message, int stop)
+{
+	te_code *code = scope->code;
+	int *exit;
+	int done;
+	int i;
+
+	exit = te_alloc(sizeof(int) * (node->child_count + 1));
+	assert(exit);
+
+	for (i = 0; i < node->child_count; i++)
+	{
+		te_emit_node(scope, node->child[i], 0);
+		exit[i] = te_emit_branch(code, op, message);
+	}
+
+	te_emit_push(code, stop ? TE_OP_FALSE : TE_OP_TRUE);
+	te_code_depth(code, -1);
+	done = te_emit_jump(code);
+
+	for (i = 0; i < node->child_count; te_emit_patch(code, exit[i++]));
+	te_emit_push(code, stop ? TE_OP_TRUE : TE_OP_FALSE);
+
+	te_emit_patch(code, done);
+	te_free(exit);
+}
+
+/*
+ * Emits the form of function in place of a call to it through name,
+ * whose operands are already pushed, behind a check that name is still
+ * bound to it. The operands are dropped under the value of the form.
+ * Returns the jump to patch past the call made when it is not.
+ */
+static int te_emit_inline(te_scope *scope, te_function *function, te_name *name, int slot, int depth, int tail)
+{
+	te_code *code = scope->code;
+	te_node *lambda = function->body;
+	te_node *form;
+	int count = lambda->binding_count;
+	int base = code->depth - count;
+	int fallback;
+	int done;
+	int i;
+
+	function->ref++;
+
+	if (slot >= 0)
+	{
+		te_emit(code, TE_OP_INLINE_LOCAL);
+		te_emit(code, depth);
+		te_emit(code, slot);
+	}
+	else
+	{
+		te_emit(code, TE_OP_INLINE_GLOBAL);
+		te_emit(code, te_code_global(code, te_global_cell(scope->te, name)));
+	}
+
+	te_emit(code, te_code_function(code, function));
+	fallback = te_emit(code, 0);
+
+	form = te_inline_form(lambda, lambda->child[0], base);
+	scope->inlining++;
+	te_emit_node(scope, form, tail);
+	scope->inlining--;
+	te_node_release(form);
+
+	if (count > 0)
+	{
+		te_emit(code, TE_OP_TEMP_SET);
+		te_emit(code, base);
+	}
+
+	for (i = 0; i < count; i++)
+		te_emit_pop(code, TE_OP_POP, 1);
+
+	done = te_emit_jump(code);
+	te_code_depth(code, count - 1);
+	te_emit_patch(code, fallback);
+
+	return done;
+}
+
+static void te_emit_apply(te_scope *scope, te_node *node, int tail)
+{
+	te_code *code = scope->code;
+	te_node *op = node->child[0];
+	te_function *function = NULL;
+	int count = node->child_count - 1;
+	int depth;
+	int slot;
+	int done;
+	int i;
+
+	for (i = 1; i < node->child_count; i++)
+		te_emit_node(scope, node->child[i], 0);
+
+	if (op->type == TE_NODE_SYMBOL)
+	{
+		slot = te_scope_resolve(scope, op->name, &depth);
+		function = te_inline_callee(scope, op->name, slot, depth, count);
+
+		if (function)
+			done = te_emit_inline(scope, function, op->name, slot, depth, tail);
+
+		if (slot >= 0)
+		{
+			te_emit(code, tail ? TE_OP_TAIL_CALL_LOCAL : TE_OP_CALL_LOCAL);
+			te_emit(code, depth);
+			te_emit(code, slot);
+		}
+		else
+		{
+			te_emit(code, tail ? TE_OP_TAIL_CALL_GLOBAL : TE_OP_CALL_GLOBAL);
+			te_emit(code, te_code_cache(code, te_global_cell(scope->te, op->name)));
+		}
+
+		te_emit(code, count);
+	}
+	else
+	{
+		te_emit_node(scope, op, 0);
+		te_emit(code, tail ? TE_OP_TAIL_CALL : TE_OP_CALL);
+		te_emit(code, count);
+		count++;
+	}
+
+	te_code_depth(code, 1 - count);
+
+	if (function)
+		te_emit_patch(code, done);
+}
+
+/*
+ * Emits the rewrite of node behind a check of each builtin it relied
+ * on, which jumps to node as written if the global was redefined.
+ */
+static void te_emit_guarded(te_scope *scope, te_node *node, int tail)
+{
+	te_code *code = scope->code;
+	te_node *optimized = node->optimized;
+	int *fallback;
+	int done;
+	int i;
+
+	fallback = te_alloc(sizeof(int) * (node->guard_count + 1));
+	assert(fallback);
+
+	for (i = 0; i < node->guard_count; i++)
+	{
+		te_symbol *cell = node->guard[i];
+
+		te_emit(code, TE_OP_GUARD);
+		te_emit(code, te_code_global(code, cell));
+		te_emit(code, te_code_constant(code, TE_VALUE_OBJECT(cell->value)));
+		fallback[i] = te_emit(code, 0);
+	}
+
+	te_emit_node(scope, optimized, tail);
+	te_code_depth(code, -1);
+	done = te_emit_jump(code);
+
+	for (i = 0; i < node->guard_count; te_emit_patch(code, fallback[i++]));
+
+	node->optimized = NULL;
+	te_emit_node(scope, node, tail);
+	node->optimized = optimized;
+
+	te_emit_patch(code, done);
+	te_free(fallback);
+}
+
+void te_emit_node(te_scope *scope, te_node *node, int tail)
+{
+	te_code *code = scope->code;
+
+	assert(node);
+
+	if (node->optimized)
+	{
+		te_emit_guarded(scope, node, tail);
+		return;
+	}
+
+	if (node->temp >= 0)
+		tail = 0;
+
+	switch (node->type)
+	{
+	case TE_NODE_CONSTANT:
+		te_emit_push(code, TE_OP_CONSTANT);
+		te_emit(code, te_code_constant(code, node->object));
+		break;
+
+	case TE_NODE_SYMBOL:
+		te_emit_symbol(scope, node->name);
+		break;
+
+	case TE_NODE_DEFINE:
+	case TE_NODE_PROCEDURE:
+		te_emit_define(scope, node);
+		break;
+
+	case TE_NODE_LAMBDA:
+		te_emit_push(code, TE_OP_LAMBDA);
+		te_emit(code, te_code_lambda(scope, node));
+		break;
+
+	case TE_NODE_COND:
+		te_emit_cond(scope, node, tail);
+		break;
+
+	case TE_NODE_IF:
+		te_emit_if(scope, node, tail);
+		break;
+
+	case TE_NODE_AND:
+		te_emit_logic(scope, node, TE_OP_JUMP_FALSE, TE_MSG_AND_OPERAND, 0);
+		break;
+
+	case TE_NODE_OR:
+		te_emit_logic(scope, node, TE_OP_JUMP_TRUE, TE_MSG_OR_OPERAND, 1);
+		break;
+
+	case TE_NODE_APPLY:
+		te_emit_apply(scope, node, tail);
+		break;
+
+	case TE_NODE_TEMP:
+		te_emit_push(code, TE_OP_TEMP);
+		te_emit(code, node->temp);
+		return;
+
+	default:
+		assert(0);
+		break;
+	}
+
+	if (node->temp >= 0)
+	{
+		te_emit(code, TE_OP_TEMP_SET);
+		te_emit(code, node->temp);
+	}
+}
+
+te_program* te_compile(tiny_eval *te, const char *expression)
+{
+	te_program *program;
+	te_lexer lexer;
+	te_scope scope;
+	tiny_eval *prev;
+	int enabled;
+
+	assert(te);
+	assert(expression);
+
+	te_set_error(te, NULL);
+
+	prev = te_current;
+	te_current = te;
+
+	program = te_alloc(sizeof(te_program));
+	assert(program);
+
+	program->body = te_node_init(TE_NODE_SEQUENCE);
+	program->code = NULL;
+
+	te_lexer_init(&lexer);
+
+	/* Constants belong to the program, which frees them itself. */
+	enabled = te->gc.enabled;
+	te->gc.enabled = 0;
+
+	if (te_lex(te, &lexer, expression))
+		te_parse_operands(te, &lexer, program->body, 0, lexer.count - 1);
+
+	te->gc.enabled = enabled;
+	te_lexer_release(&lexer);
+
+	if (!te_error(te))
+	{
+		program->code = te_code_init();
+		te_scope_init(&scope, te, program->code, NULL);
+		te_emit_temps(program->code, te_optimize_body(&scope, program->body));
+		te_emit_sequence(&scope, program->body, 0, 0);
+		te_emit_pop(program->code, TE_OP_RETURN, 1);
+		te_scope_release(&scope);
+	}
+
+	te_current = prev;
+
+	if (te_error(te))
+	{
+		te_program_release(program);
+		return NULL;
+	}
+
+	return program;
+}
+
+void te_program_release(te_program *program)
+{
+	if (program)
+	{
+		te_code_release(program->code);
+		te_node_release(program->body);
+		te_free(program);
+	}
+}
+
+/* Hands an object to the region, to be let go of at the next reset. */
+static void te_region_keep(te_region *region, te_object *object)
+{
+	if (region->final_count >= region->final_cap)
+	{
+		region->final_cap = region->final_cap ? region->final_cap * 2 : 16;
+		region->final = te_realloc(region->final, sizeof(te_object*) * region->final_cap);
+		assert(region->final);
+	}
+
+	region->final[region->final_count++] = object;
+}
+
+te_object* te_make_lambda(tiny_eval *te, te_function *function)
+{
+	te_object *out = te_make_native(te_lambda_native, te_lambda_init(te, function));
+
+	if (te->region.active)
+		te_region_keep(&te->region, out);
+
+	return out;
+}
+
+static const char *te_message[] =
+{
+	"cond: unexpected conditional result",
+	"if: unexpected conditional result",
+	"if: unexpected end of expression",
+	"and: operand is not a boolean value",
+	"or: operand is not a boolean value"
+};
+
+/*
+ * Dispatch is threaded through a label table where the compiler
+ * supports computed goto, and falls back to a switch otherwise.
+ */
+#if defined(__GNUC__) && !defined(TE_NO_THREADED_DISPATCH)
+#define TE_THREADED_DISPATCH
+#endif
+
+#ifdef TE_THREADED_DISPATCH
+#define TE_VM_LABEL(name) &&te_vm_##name,
+#define TE_VM_SWITCH() goto *te_vm_label[*pc++];
+#define TE_VM_CASE(name) te_vm_TE_OP_##name:
+#define TE_VM_NEXT() goto *te_vm_label[*pc++]
+#else
+#define TE_VM_SWITCH() te_vm_dispatch: switch (*pc++)
+#define TE_VM_CASE(name) case TE_OP_##name:
+#define TE_VM_NEXT() goto te_vm_dispatch
+#endif
+
+/*
+ * Checks that a named operator holds a procedure. te_cache_update uses
+ * it to refill a call site cache from its cell, so unbound cells and
+ * values that are not procedures are reported and never cached.
+ */
+static te_object* te_operator(tiny_eval *te, te_value value)
+{
+	if (value == TE_VALUE_UNBOUND)
+	{
+		te_set_error(te, "apply: unbound procedure");
+		return NULL;
+	}
+
+	if (te_value_type(value) != TE_TYPE_PROCEDURE)
+	{
+		te_set_error(te, "apply: operator is not a procedure");
+		return NULL;
+	}
+
+	return TE_VALUE_OBJECT(value);
+}
+
+static int te_cache_update(tiny_eval *te, te_cache *cache)
+{
+	te_object *fun = te_operator(te, cache->cell->value);
+
+	if (!fun)
+		return 0;
+
+	cache->version = te->global_version;
+	cache->procedure = fun;
+	cache->native = fun->data.procedure->native;
+	cache->user = fun->data.procedure->user;
+
+	return 1;
+}
+
+/* Walks depth frames out from env. */
+static te_environment* te_frame(te_environment *env, int depth)
+{
+	for (; depth > 0; depth--)
+		env = env->link;
+
+	return env;
+}
+
+/* Moves the count operands at operand aside, for a tail call to take. */
+static void te_tail_set(tiny_eval *te, te_value *operand, int count)
+{
+	te_tail *tail = &te->tail;
+
+	if (count > tail->cap)
+	{
+		tail->cap = count > 8 ? count : 8;
+		te_free(tail->operand);
+		tail->operand = te_alloc(sizeof(te_value) * tail->cap);
+		assert(tail->operand);
+	}
+
+	if (count)
+		memcpy(tail->operand, operand, sizeof(te_value) * count);
+}
+
+/*
+ * Whether the memory a call to function takes would go over the limit:
+ * its frame, its value stack window, a stack block to hold them if the
+ * stack has none left, and a larger continuation array if that is full.
+ */
+static int te_frame_over(tiny_eval *te, te_function *function)
+{
+	te_stack_block *block = te->stack;
+	te_calls *calls = &te->calls;
+	size_t frame;
+	size_t stack;
+	size_t need = 0;
+
+	if (!te->pool->limit)
+		return 0;
+
+	frame = (sizeof(te_environment) + sizeof(te_value) * function->slot_count + 7) & ~(size_t)7;
+	stack = (sizeof(te_value) * (function->code->stack_size + 1) + 7) & ~(size_t)7;
+
+	if (function->capture)
+		need += sizeof(te_chunk) + frame;
+	else
+		stack += frame;
+
+	if (block->top + stack > block->size && (!block->next || block->next->size < stack))
+		need += sizeof(te_chunk) + sizeof(te_stack_block) + (stack > TE_STACK_BLOCK ? stack : TE_STACK_BLOCK);
+
+	if (calls->count >= calls->cap)
+		need += sizeof(te_chunk) + sizeof(te_continuation) * (calls->cap ? calls->cap * 2 : 64);
+
+	return te_pool_over(te->pool, need);
+}
+
+/* Checks a lambda can be entered with count operands. */
+static int te_frame_check(tiny_eval *te, te_lambda_data *lambda, int count)
+{
+	/* Only a memory limit leaves an error behind while code still runs. */
+	if (te->error)
+		return 0;
+
+	if (lambda->function->binding_count != count)
+	{
+		te_set_error(te, "lambda: mismatch operand count");
+		return 0;
+	}
+
+	return !te_frame_over(te, lambda->function);
+}
+
+/*
+ * Frees the stack blocks and continuations a run grew to, once nothing
+ * runs, so that after one deep or failed run the memory a limit counts
+ * is only what is live again.
+ */
+static void te_calls_trim(tiny_eval *te)
+{
+	te_calls *calls = &te->calls;
+
+	if (te->stack->top || te->stack->prev)
+		return;
+
+	while (te->stack->next)
+	{
+		te_stack_block *next = te->stack->next;
+
+		te->stack->next = next->next;
+		te_free(next);
+	}
+
+	if (calls->count == 0 && calls->record)
+	{
+		te_free(calls->record);
+		calls->record = NULL;
+		calls->cap = 0;
+	}
+}
+
+/*
+ * Makes the frame of a call to lambda, taking over the operands. Frames
+ * that closures may capture go on the heap, the rest on the interpreter
+ * stack, where the value stack window of the call follows them. A heap
+ * frame can outlive the call, so it holds on to the frame it links to;
+ * a stack frame relies on the lambda being held while it runs.
+ */
+static te_environment* te_frame_enter(tiny_eval *te, te_lambda_data *lambda, te_value operands[], int count)
+{
+	te_function *function = lambda->function;
+	te_environment *frame;
+	size_t size;
+	int i;
+
+	size = sizeof(te_environment) + sizeof(te_value) * function->slot_count;
+
+	if (function->capture)
+	{
+		frame = te_alloc(size);
+		assert(frame);
+		frame->ref = 1;
+
+		if (lambda->link)
+			lambda->link->ref++;
+	}
+	else
+	{
+		frame = te_stack_alloc(te, size);
+		frame->ref = 0;
+	}
+
+	frame->mark = 0;
+	frame->link = lambda->link;
+	frame->slot = (te_value*)(frame + 1);
+	frame->slot_count = function->slot_count;
+
+	for (i = 0; i < count; i++)
+		frame->slot[i] = operands[i];
+
+	for (; i < function->slot_count; i++)
+		frame->slot[i] = TE_VALUE_UNBOUND;
+
+	return frame;
+}
+
+/* Leaves a lambda call, returning an arena frame to the arena. */
+static void te_frame_leave(tiny_eval *te, te_environment *frame)
+{
+	int i;
+
+	if (frame->ref == 0)
+	{
+		for (i = 0; i < frame->slot_count; i++)
+			te_value_release(frame->slot[i]);
+
+		te_stack_free(te, frame);
+	}
+	else
+	{
+		te_frame_collect(frame, 1);
+		te_frame_release(frame);
+	}
+}
+
+/* Raises an error if more calls would nest deeper than the limit. */
+static int te_depth_exceeded(tiny_eval *te, int more)
+{
+	te_calls *calls = &te->calls;
+
+	if (calls->limit > 0 && calls->count + calls->nested + more > calls->limit)
+	{
+		te_set_error(te, "apply: maximum call depth exceeded");
+		return 1;
+	}
+
+	return 0;
+}
+
+static te_continuation* te_continuation_push(tiny_eval *te)
+{
+	te_calls *calls = &te->calls;
+
+	if (calls->count >= calls->cap)
+	{
+		calls->cap = calls->cap ? calls->cap * 2 : 64;
+		calls->record = te_realloc(calls->record, sizeof(te_continuation) * calls->cap);
+		assert(calls->record);
+	}
+
+	return &calls->record[calls->count++];
+}
+
+#ifdef TE_JIT
+
+/*
+ * The native tier. A lambda called TE_JIT_THRESHOLD times has its
+ * bytecode translated to x86-64, if every value its body computes can
+ * be typed as a number or a boolean given numbers for operands. That
+ * covers constants, parameters, numeric globals, the arithmetic and
+ * comparison builtins, if, and, or, and calls to lambdas that qualify
+ * in turn, though not to themselves. Integers may only appear as
+ * constants combined with numbers, so the code computes in double
+ * exactly as the builtins would. The code keeps values in scratch,
+ * addressed through rbp, and reads operands through rbx. It is good
+ * only for the globals it was compiled against, and only runs when
+ * every operand is a number; anything else is left to the interpreter.
+ * Globals bound to batch columns change per row, so are never compiled.
+ */
+#define TE_JIT_THRESHOLD 1000
+#define TE_JIT_MAX_INTEGER (((te_int64)1) << 53)
+
+typedef te_value (*te_jit_entry)(const te_value *operands, te_value *scratch);
+
+/*
+ * entry is NULL when the body cannot be compiled. need is the scratch
+ * the code uses, the lambdas it calls included; it holds on to those.
+ */
+struct tag_te_jit
+{
+	te_jit_entry entry;
+	void *memory;
+	size_t size;
+	unsigned int version;
+	te_type type;
+	int need;
+	struct tag_te_function **callee;
+	int callee_count;
+	int compiling;
+};
+
+typedef struct tag_te_jit te_jit;
+
+#define TE_REG_RAX 0
+#define TE_REG_RCX 1
+#define TE_REG_RDX 2
+#define TE_REG_RBX 3
+#define TE_REG_RBP 5
+#define TE_REG_RSI 6
+#define TE_REG_RDI 7
+
+#ifdef _WIN32
+#define TE_REG_ARG0 TE_REG_RCX
+#define TE_REG_ARG1 TE_REG_RDX
+#else
+#define TE_REG_ARG0 TE_REG_RDI
+#define TE_REG_ARG1 TE_REG_RSI
+#endif
+
+/* Operands following each opcode, for walking bytecode. */
+static const int te_op_operands[TE_OP_COUNT] =
+{
+	0, 0, 0, 1, 2, 1, 1, 1, 1, 1, 1, 0, 1, 2, 2, 3, 3, 4, 1, 3, 2, 1, 3, 2, 1, 0
+};
+
+/* A jump whose rel32 at pos still has to be pointed at bytecode target. */
+typedef struct tag_te_jit_fixup
+{
+	size_t pos;
+	int target;
+}
+te_jit_fixup;
+
+/*
+ * The translation of one body. type is the type of each value stack
+ * slot; a jump records it for its target in label_depth and label_type,
+ * and falling into a target must agree with what was recorded.
+ */
+typedef struct tag_te_jit_state
+{
+	tiny_eval *te;
+	te_function *function;
+	te_jit *jit;
+	unsigned char *byte;
+	size_t count;
+	size_t cap;
+	te_type *type;
+	int depth;
+	int *label_depth;
+	te_type *label_type;
+	size_t *at;
+	te_jit_fixup *fixup;
+	int fixup_count;
+	int fixup_cap;
+}
+te_jit_state;
+
+static void te_jit_byte(te_jit_state *state, int byte)
+{
+	if (state->count >= state->cap)
+	{
+		state->cap = state->cap ? state->cap * 2 : 256;
+		state->byte = te_realloc(state->byte, state->cap);
+		assert(state->byte);
+	}
+
+	state->byte[state->count++] = (unsigned char)byte;
+}
+
+static void te_jit_int32(te_jit_state *state, te_int64 value)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		te_jit_byte(state, (int)((value >> (i * 8)) & 0xFF));
+}
+
+/* mov rax (or rcx), imm64 */
+static void te_jit_imm64(te_jit_state *state, int reg, te_value value)
+{
+	int i;
+
+	te_jit_byte(state, 0x48);
+	te_jit_byte(state, 0xB8 + reg);
+
+	for (i = 0; i < 8; i++)
+		te_jit_byte(state, (int)((value >> (i * 8)) & 0xFF));
+}
+
+/*
+ * Emits an instruction with a [base + 8 * slot] operand: an optional
+ * prefix and REX byte, one or two opcode bytes, then the ModRM byte for
+ * reg and a 32-bit displacement.
+ */
+static void te_jit_slot(te_jit_state *state, int prefix, int rex, int op, int op2, int reg, int base, int slot)
+{
+	if (prefix)
+		te_jit_byte(state, prefix);
+
+	if (rex)
+		te_jit_byte(state, rex);
+
+	te_jit_byte(state, op);
+
+	if (op2 >= 0)
+		te_jit_byte(state, op2);
+
+	te_jit_byte(state, 0x80 | (reg << 3) | base);
+	te_jit_int32(state, (te_int64)slot * 8);
+}
+
+#define te_jit_load(state, base, slot)  te_jit_slot(state, 0, 0x48, 0x8B, -1, TE_REG_RAX, base, slot)
+#define te_jit_store(state, slot)       te_jit_slot(state, 0, 0x48, 0x89, -1, TE_REG_RAX, TE_REG_RBP, slot)
+#define te_jit_sse(state, op, slot)     te_jit_slot(state, 0xF2, 0, 0x0F, op, 0, TE_REG_RBP, slot)
+#define te_jit_ucomisd(state, slot)     te_jit_slot(state, 0x66, 0, 0x0F, 0x2E, 0, TE_REG_RBP, slot)
+#define te_jit_lea(state, reg, slot)    te_jit_slot(state, 0, 0x48, 0x8D, -1, reg, TE_REG_RBP, slot)
+
+#define TE_SSE_LOAD  0x10
+#define TE_SSE_STORE 0x11
+#define TE_SSE_ADD   0x58
+#define TE_SSE_MUL   0x59
+#define TE_SSE_SUB   0x5C
+#define TE_SSE_DIV   0x5E
+
+static void te_jit_value(te_jit_state *state, int slot, te_value value)
+{
+	te_jit_imm64(state, TE_REG_RAX, value);
+	te_jit_store(state, slot);
+}
+
+static void te_jit_number(te_jit_state *state, int slot, double number)
+{
+	te_value value;
+
+	memcpy(&value, &number, sizeof(value));
+	te_jit_value(state, slot, value);
+}
+
+/* jcc or jmp rel32 to bytecode target, resolved once it is emitted. */
+static void te_jit_jump(te_jit_state *state, int cc, int target)
+{
+	if (cc)
+	{
+		te_jit_byte(state, 0x0F);
+		te_jit_byte(state, cc);
+	}
+	else
+	{
+		te_jit_byte(state, 0xE9);
+	}
+
+	if (state->fixup_count >= state->fixup_cap)
+	{
+		state->fixup_cap = state->fixup_cap ? state->fixup_cap * 2 : 16;
+		state->fixup = te_realloc(state->fixup, sizeof(te_jit_fixup) * state->fixup_cap);
+		assert(state->fixup);
+	}
+
+	state->fixup[state->fixup_count].pos = state->count;
+	state->fixup[state->fixup_count].target = target;
+	state->fixup_count++;
+
+	te_jit_int32(state, 0);
+}
+
+static void te_jit_epilogue(te_jit_state *state)
+{
+	te_jit_byte(state, 0x48);
+	te_jit_byte(state, 0x83);
+	te_jit_byte(state, 0xC4);
+	te_jit_byte(state, 0x28);
+	te_jit_byte(state, 0x5D);
+	te_jit_byte(state, 0x5B);
+	te_jit_byte(state, 0xC3);
+}
+
+/* Records the state a jump to target arrives with. */
+static int te_jit_label(te_jit_state *state, int target)
+{
+	int size = state->function->code->stack_size + 1;
+
+	if (target <= 0 || target >= state->function->code->op_count)
+		return 0;
+
+	if (state->label_depth[target] < 0)
+	{
+		state->label_depth[target] = state->depth;
+		memcpy(state->label_type + target * size, state->type, sizeof(te_type) * state->depth);
+		return 1;
+	}
+
+	return state->label_depth[target] == state->depth &&
+		memcmp(state->label_type + target * size, state->type, sizeof(te_type) * state->depth) == 0;
+}
+
+static int te_jit_numeric(te_type type)
+{
+	return type == TE_TYPE_INTEGER || type == TE_TYPE_NUMBER;
+}
+
+/* Pushes a constant or the value of a global. */
+static int te_jit_constant(te_jit_state *state, te_value value)
+{
+	int slot = state->depth;
+	te_int64 integer;
+
+	switch (te_value_type(value))
+	{
+	case TE_TYPE_NUMBER:
+		te_jit_value(state, slot, value);
+		break;
+
+	case TE_TYPE_INTEGER:
+		integer = te_value_integer(value);
+
+		if (integer > TE_JIT_MAX_INTEGER || integer < -TE_JIT_MAX_INTEGER)
+			return 0;
+
+		te_jit_number(state, slot, (double)integer);
+		break;
+
+	case TE_TYPE_BOOLEAN:
+		te_jit_value(state, slot, value);
+		break;
+
+	default:
+		return 0;
+	}
+
+	state->type[state->depth++] = te_value_type(value);
+	return 1;
+}
+
+static te_jit* te_jit_compile(tiny_eval *te, te_function *function);
+
+/* Calls a lambda with native code, its operands at base. */
+static int te_jit_lambda(te_jit_state *state, te_lambda_data *lambda, int base, int count)
+{
+	te_function *callee = lambda->function;
+	te_jit *jit = callee->jit;
+	int i;
+
+	if (callee == state->function || callee->binding_count != count)
+		return 0;
+
+	if (!jit || jit->version != state->te->global_version)
+		jit = te_jit_compile(state->te, callee);
+
+	if (jit->compiling || !jit->entry)
+		return 0;
+
+	for (i = base; i < base + count; i++)
+	{
+		if (state->type[i] != TE_TYPE_NUMBER)
+			return 0;
+	}
+
+	state->jit->callee = te_realloc(state->jit->callee, sizeof(te_function*) * (state->jit->callee_count + 1));
+	assert(state->jit->callee);
+	state->jit->callee[state->jit->callee_count++] = callee;
+	callee->ref++;
+
+	if (base + count + jit->need > state->jit->need)
+		state->jit->need = base + count + jit->need;
+
+	te_jit_lea(state, TE_REG_ARG0, base);
+	te_jit_lea(state, TE_REG_ARG1, base + count);
+	te_jit_imm64(state, TE_REG_RAX, (te_value)(size_t)jit->memory);
+	te_jit_byte(state, 0xFF);
+	te_jit_byte(state, 0xD0);
+	te_jit_store(state, base);
+
+	state->type[base] = jit->type;
+	return 1;
+}
+
+/* Folds the operands at base left to right with an SSE operation. */
+static void te_jit_fold(te_jit_state *state, int op, int base, int count)
+{
+	int i;
+
+	te_jit_sse(state, TE_SSE_LOAD, base);
+
+	for (i = 1; i < count; i++)
+		te_jit_sse(state, op, base + i);
+
+	te_jit_sse(state, TE_SSE_STORE, base);
+}
+
+/*
+ * Compares each neighbouring pair of the operands at base into ecx.
+ * The order of the ucomisd operands and the flag set make a NaN compare
+ * false, as it does in C.
+ */
+static void te_jit_compare(te_jit_state *state, te_native native, int base, int count)
+{
+	int i;
+
+	te_jit_byte(state, 0xB9);
+	te_jit_int32(state, 1);
+
+	for (i = base + 1; i < base + count; i++)
+	{
+		int swap = native == te_lesser || native == te_lesser_equal;
+		int cc = native == te_equal ? 0x94 :
+			native == te_lesser || native == te_greater ? 0x97 : 0x93;
+
+		te_jit_sse(state, TE_SSE_LOAD, swap ? i : i - 1);
+		te_jit_ucomisd(state, swap ? i - 1 : i);
+
+		/* setcc al */
+		te_jit_byte(state, 0x0F);
+		te_jit_byte(state, cc);
+		te_jit_byte(state, 0xC0);
+
+		if (native == te_equal)
+		{
+			/* setnp dl; and al, dl */
+			te_jit_byte(state, 0x0F);
+			te_jit_byte(state, 0x9B);
+			te_jit_byte(state, 0xC2);
+			te_jit_byte(state, 0x20);
+			te_jit_byte(state, 0xD0);
+		}
+
+		/* movzx eax, al; and ecx, eax */
+		te_jit_byte(state, 0x0F);
+		te_jit_byte(state, 0xB6);
+		te_jit_byte(state, 0xC0);
+		te_jit_byte(state, 0x21);
+		te_jit_byte(state, 0xC1);
+	}
+
+	/* or rax, rcx */
+	te_jit_imm64(state, TE_REG_RAX, TE_VALUE_FALSE);
+	te_jit_byte(state, 0x48);
+	te_jit_byte(state, 0x09);
+	te_jit_byte(state, 0xC8);
+	te_jit_store(state, base);
+}
+
+/*
+ * Calls the procedure in a global cell with the count operands at the
+ * top of the value stack, leaving its result in their place. Mirrors
+ * te_arith_fold and the other builtins, type rule for type rule.
+ */
+static int te_jit_call(te_jit_state *state, te_symbol *cell, int count)
+{
+	int base = state->depth - count;
+	te_type *type = state->type + base;
+	te_object *procedure;
+	te_native native;
+	int i;
+
+	if (te_value_type(cell->value) != TE_TYPE_PROCEDURE)
+		return 0;
+
+	procedure = TE_VALUE_OBJECT(cell->value);
+	native = procedure->data.procedure->native;
+
+	if (native == te_lambda_native)
+	{
+		if (!te_jit_lambda(state, procedure->data.procedure->user, base, count))
+			return 0;
+
+		state->depth = base + 1;
+		return 1;
+	}
+
+	if (native == te_not)
+	{
+		if (count != 1)
+			return 0;
+
+		if (type[0] == TE_TYPE_BOOLEAN)
+		{
+			te_jit_load(state, TE_REG_RBP, base);
+			te_jit_byte(state, 0x48);
+			te_jit_byte(state, 0x83);
+			te_jit_byte(state, 0xF0);
+			te_jit_byte(state, 0x01);
+			te_jit_store(state, base);
+		}
+		else
+		{
+			te_jit_value(state, base, TE_VALUE_FALSE);
+		}
+
+		type[0] = TE_TYPE_BOOLEAN;
+		state->depth = base + 1;
+		return 1;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		if (!te_jit_numeric(type[i]))
+			return 0;
+	}
+
+	if (native == te_plus || native == te_multiplies)
+	{
+		if (count == 0)
+		{
+			te_jit_number(state, base, native == te_plus ? 0 : 1);
+			type[0] = TE_TYPE_INTEGER;
+		}
+		else if (count > 1)
+		{
+			if (type[0] == TE_TYPE_INTEGER && type[1] == TE_TYPE_INTEGER)
+				return 0;
+
+			te_jit_fold(state, native == te_plus ? TE_SSE_ADD : TE_SSE_MUL, base, count);
+			type[0] = TE_TYPE_NUMBER;
+		}
+	}
+	else if (native == te_minus)
+	{
+		if (count == 0 || (type[0] == TE_TYPE_INTEGER && (count == 1 || type[1] == TE_TYPE_INTEGER)))
+			return 0;
+
+		if (count == 1)
+		{
+			double minus = -1;
+			te_value value;
+
+			/* movq xmm0, rax; multiplying keeps the sign of a zero */
+			memcpy(&value, &minus, sizeof(value));
+			te_jit_imm64(state, TE_REG_RAX, value);
+			te_jit_byte(state, 0x66);
+			te_jit_byte(state, 0x48);
+			te_jit_byte(state, 0x0F);
+			te_jit_byte(state, 0x6E);
+			te_jit_byte(state, 0xC0);
+			te_jit_sse(state, TE_SSE_MUL, base);
+			te_jit_sse(state, TE_SSE_STORE, base);
+		}
+		else
+		{
+			te_jit_fold(state, TE_SSE_SUB, base, count);
+		}
+
+		type[0] = TE_TYPE_NUMBER;
+	}
+	else if (native == te_divides)
+	{
+		if (count == 0)
+			return 0;
+
+		if (count == 1)
+		{
+			double one = 1;
+			te_value value;
+
+			/* movq xmm0, rax */
+			memcpy(&value, &one, sizeof(value));
+			te_jit_imm64(state, TE_REG_RAX, value);
+			te_jit_byte(state, 0x66);
+			te_jit_byte(state, 0x48);
+			te_jit_byte(state, 0x0F);
+			te_jit_byte(state, 0x6E);
+			te_jit_byte(state, 0xC0);
+			te_jit_sse(state, TE_SSE_DIV, base);
+			te_jit_sse(state, TE_SSE_STORE, base);
+		}
+		else
+		{
+			te_jit_fold(state, TE_SSE_DIV, base, count);
+		}
+
+		type[0] = TE_TYPE_NUMBER;
+	}
+	else if (native == te_equal || native == te_lesser || native == te_lesser_equal ||
+		native == te_greater || native == te_greater_equal)
+	{
+		if (count < 2)
+			te_jit_value(state, base, TE_VALUE_TRUE);
+		else
+			te_jit_compare(state, native, base, count);
+
+		type[0] = TE_TYPE_BOOLEAN;
+	}
+	else
+	{
+		return 0;
+	}
+
+	state->depth = base + 1;
+	return 1;
+}
+
+static int te_jit_return(te_jit_state *state)
+{
+	te_type type = state->type[--state->depth];
+
+	if (type != TE_TYPE_NUMBER && type != TE_TYPE_BOOLEAN)
+		return 0;
+
+	if (state->jit->type != TE_TYPE_NIL && state->jit->type != type)
+		return 0;
+
+	state->jit->type = type;
+	te_jit_load(state, TE_REG_RBP, state->depth);
+	te_jit_epilogue(state);
+	return 1;
+}
+
+/* Translates the body op by op; returns 0 at the first it cannot. */
+static int te_jit_translate(te_jit_state *state)
+{
+	te_code *code = state->function->code;
+	int size = code->stack_size + 1;
+	int live = 1;
+	int pc = 0;
+
+	while (pc < code->op_count)
+	{
+		int op = code->op[pc];
+		const int *arg = code->op + pc + 1;
+		int next = pc + 1 + te_op_operands[op];
+
+		if (state->label_depth[pc] >= 0)
+		{
+			if (!live)
+			{
+				state->depth = state->label_depth[pc];
+				memcpy(state->type, state->label_type + pc * size, sizeof(te_type) * state->depth);
+				live = 1;
+			}
+			else if (!te_jit_label(state, pc))
+			{
+				return 0;
+			}
+		}
+
+		state->at[pc] = state->count;
+
+		if (!live)
+		{
+			pc = next;
+			continue;
+		}
+
+		switch (op)
+		{
+		case TE_OP_NIL:
+			te_jit_value(state, state->depth, TE_VALUE_NIL);
+			state->type[state->depth++] = TE_TYPE_NIL;
+			break;
+
+		case TE_OP_TRUE:
+		case TE_OP_FALSE:
+			if (!te_jit_constant(state, op == TE_OP_TRUE ? TE_VALUE_TRUE : TE_VALUE_FALSE))
+				return 0;
+			break;
+
+		case TE_OP_CONSTANT:
+			if (!te_jit_constant(state, code->constant[arg[0]]))
+				return 0;
+			break;
+
+		case TE_OP_GLOBAL:
+			if (code->global[arg[0]]->column || !te_jit_constant(state, code->global[arg[0]]->value))
+				return 0;
+			break;
+
+		case TE_OP_LOCAL:
+			if (arg[0] != 0 || arg[1] >= state->function->binding_count)
+				return 0;
+
+			te_jit_load(state, TE_REG_RBX, arg[1]);
+			te_jit_store(state, state->depth);
+			state->type[state->depth++] = TE_TYPE_NUMBER;
+			break;
+
+		case TE_OP_TEMP:
+			te_jit_load(state, TE_REG_RBP, arg[0]);
+			te_jit_store(state, state->depth);
+			state->type[state->depth++] = state->type[arg[0]];
+			break;
+
+		case TE_OP_TEMP_SET:
+			te_jit_load(state, TE_REG_RBP, state->depth - 1);
+			te_jit_store(state, arg[0]);
+			state->type[arg[0]] = state->type[state->depth - 1];
+			break;
+
+		case TE_OP_POP:
+			state->depth--;
+			break;
+
+		/* The globals are fixed while the code runs, so it goes one way. */
+		case TE_OP_GUARD:
+		case TE_OP_INLINE_GLOBAL:
+			if (op == TE_OP_GUARD ? code->global[arg[0]]->value == code->constant[arg[1]] :
+				te_lambda_function(code->global[arg[0]]->value) == code->lambda[arg[1]])
+				break;
+
+			if (arg[2] <= pc || !te_jit_label(state, arg[2]))
+				return 0;
+
+			te_jit_jump(state, 0, arg[2]);
+			live = 0;
+			break;
+
+		case TE_OP_JUMP:
+			if (arg[0] <= pc || !te_jit_label(state, arg[0]))
+				return 0;
+
+			te_jit_jump(state, 0, arg[0]);
+			live = 0;
+			break;
+
+		case TE_OP_JUMP_FALSE:
+		case TE_OP_JUMP_TRUE:
+			if (state->type[--state->depth] != TE_TYPE_BOOLEAN ||
+				arg[0] <= pc || !te_jit_label(state, arg[0]))
+				return 0;
+
+			/* cmp rax, rcx */
+			te_jit_load(state, TE_REG_RBP, state->depth);
+			te_jit_imm64(state, TE_REG_RCX, TE_VALUE_TRUE);
+			te_jit_byte(state, 0x48);
+			te_jit_byte(state, 0x39);
+			te_jit_byte(state, 0xC8);
+			te_jit_jump(state, op == TE_OP_JUMP_FALSE ? 0x85 : 0x84, arg[0]);
+			break;
+
+		case TE_OP_CALL_GLOBAL:
+		case TE_OP_TAIL_CALL_GLOBAL:
+			if (!te_jit_call(state, code->cache[arg[0]].cell, arg[1]))
+				return 0;
+
+			if (op == TE_OP_TAIL_CALL_GLOBAL)
+			{
+				if (!te_jit_return(state))
+					return 0;
+
+				live = 0;
+			}
+			break;
+
+		case TE_OP_RETURN:
+			if (!te_jit_return(state))
+				return 0;
+
+			live = 0;
+			break;
+
+		default:
+			return 0;
+		}
+
+		pc = next;
+	}
+
+	return state->jit->type != TE_TYPE_NIL;
+}
+
+/* Copies code into memory of its own that can run but not be written. */
+static void* te_jit_map(const void *code, size_t size)
+{
+	void *memory;
+
+#ifdef _WIN32
+	DWORD protect;
+
+	memory = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+	if (!memory)
+		return NULL;
+
+	memcpy(memory, code, size);
+
+	if (!VirtualProtect(memory, size, PAGE_EXECUTE_READ, &protect))
+	{
+		VirtualFree(memory, 0, MEM_RELEASE);
+		return NULL;
+	}
+
+	FlushInstructionCache(GetCurrentProcess(), memory, size);
+#else
+	memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+
+	if (memory == MAP_FAILED)
+		return NULL;
+
+	memcpy(memory, code, size);
+
+	if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0)
+	{
+		munmap(memory, size);
+		return NULL;
+	}
+#endif
+
+	return memory;
+}
+
+static void te_jit_unmap(void *memory, size_t size)
+{
+#ifdef _WIN32
+	UNUSED(size);
+	VirtualFree(memory, 0, MEM_RELEASE);
+#else
+	munmap(memory, size);
+#endif
+}
+
+static void te_jit_release(te_jit *jit)
+{
+	int i;
+
+	if (jit)
+	{
+		if (jit->memory)
+			te_jit_unmap(jit->memory, jit->size);
+
+		for (i = 0; i < jit->callee_count; te_function_release(jit->callee[i++]));
+
+		if (jit->callee)
+			te_free(jit->callee);
+
+		te_free(jit);
+	}
+}
+
+/* Compiles function against the current globals, replacing older code. */
+static te_jit* te_jit_compile(tiny_eval *te, te_function *function)
+{
+	te_code *code = function->code;
+	int size = code->stack_size + 1;
+	te_jit_state state;
+	te_jit *jit;
+	int i;
+
+	te_jit_release(function->jit);
+
+	jit = te_alloc(sizeof(te_jit));
+	assert(jit);
+
+	jit->entry = NULL;
+	jit->memory = NULL;
+	jit->size = 0;
+	jit->version = te->global_version;
+	jit->type = TE_TYPE_NIL;
+	jit->need = size;
+	jit->callee = NULL;
+	jit->callee_count = 0;
+	jit->compiling = 1;
+	function->jit = jit;
+
+	state.te = te;
+	state.function = function;
+	state.jit = jit;
+	state.byte = NULL;
+	state.count = 0;
+	state.cap = 0;
+	state.depth = 0;
+	state.fixup = NULL;
+	state.fixup_count = 0;
+	state.fixup_cap = 0;
+	state.type = te_alloc(sizeof(te_type) * size);
+	state.label_depth = te_alloc(sizeof(int) * (code->op_count + 1));
+	state.label_type = te_alloc(sizeof(te_type) * size * (code->op_count + 1));
+	state.at = te_alloc(sizeof(size_t) * (code->op_count + 1));
+	assert(state.type && state.label_depth && state.label_type && state.at);
+
+	for (i = 0; i <= code->op_count; state.label_depth[i++] = -1);
+
+	/* push rbx; push rbp; sub rsp, 40; mov rbx, arg0; mov rbp, arg1 */
+	te_jit_byte(&state, 0x53);
+	te_jit_byte(&state, 0x55);
+	te_jit_byte(&state, 0x48);
+	te_jit_byte(&state, 0x83);
+	te_jit_byte(&state, 0xEC);
+	te_jit_byte(&state, 0x28);
+	te_jit_byte(&state, 0x48);
+	te_jit_byte(&state, 0x89);
+	te_jit_byte(&state, 0xC0 | (TE_REG_ARG0 << 3) | TE_REG_RBX);
+	te_jit_byte(&state, 0x48);
+	te_jit_byte(&state, 0x89);
+	te_jit_byte(&state, 0xC0 | (TE_REG_ARG1 << 3) | TE_REG_RBP);
+
+	if (te_jit_translate(&state))
+	{
+		size_t end = state.count;
+
+		for (i = 0; i < state.fixup_count; i++)
+		{
+			size_t pos = state.fixup[i].pos;
+
+			state.count = pos;
+			te_jit_int32(&state, (te_int64)state.at[state.fixup[i].target] - (te_int64)(pos + 4));
+		}
+
+		jit->memory = te_jit_map(state.byte, end);
+
+		if (jit->memory)
+		{
+			jit->size = end;
+			memcpy(&jit->entry, &jit->memory, sizeof(jit->entry));
+		}
+	}
+
+	jit->compiling = 0;
+
+	te_free(state.byte);
+	te_free(state.type);
+	te_free(state.label_depth);
+	te_free(state.label_type);
+	te_free(state.at);
+	te_free(state.fixup);
+
+	return jit;
+}
+
+/*
+ * Runs a call to function natively, if it has code for the current
+ * globals and every operand is a number. Calls that cannot be are
+ * counted, and compile it again once there have been enough of them.
+ */
+static int te_jit_enter(tiny_eval *te, te_function *function, const te_value operands[], int count, te_value *result)
+{
+	te_jit *jit = function->jit;
+	double number;
+	int i;
+
+	if (!jit || jit->version != te->global_version)
+	{
+		if (++function->calls < TE_JIT_THRESHOLD)
+			return 0;
+
+		function->calls = 0;
+		jit = te_jit_compile(te, function);
+	}
+
+	if (!jit->entry)
+		return 0;
+
+	for (i = 0; i < count; i++)
+	{
+		if (!TE_VALUE_IS_NUMBER(operands[i]))
+			return 0;
+	}
+
+	if (jit->need > te->scratch.cap)
+	{
+		te->scratch.cap = jit->need;
+		te_free(te->scratch.value);
+		te->scratch.value = te_alloc(sizeof(te_value) * te->scratch.cap);
+		assert(te->scratch.value);
+	}
+
+	*result = jit->entry(operands, te->scratch.value);
+
+	if (jit->type == TE_TYPE_NUMBER)
+	{
+		memcpy(&number, result, sizeof(number));
+		*result = te_value_from_number(number);
+	}
+
+	return 1;
+}
+
+#else
+
+static void te_jit_release(struct tag_te_jit *jit)
+{
+	assert(!jit);
+}
+
+#define te_jit_enter(te, function, operands, count, result) 0
+
+#endif
+
+/*
+ * Runs code in frame, or at the top level when frame is NULL. Calls to
+ * lambdas do not recurse: the caller is saved on te->calls and the
+ * callee runs in its place, so the depth of user code costs heap rather
+ * than C stack. held is the lambda the running code belongs to, for
+ * the calls made here; the caller of te_execute holds the first one.
+ */
+static te_value te_execute(tiny_eval *te, te_code *code, te_environment *frame)
+{
+#ifdef TE_THREADED_DISPATCH
+#define TE_OP_LABEL(name) &&te_vm_TE_OP_##name,
+	static const void *te_vm_label[] = { TE_OPCODES(TE_OP_LABEL) NULL };
+#undef TE_OP_LABEL
+#endif
+	const int *pc;
+	te_value *stack;
+	te_value *sp;
+	te_value result = TE_VALUE_NIL;
+	te_environment *prev = te->env;
+	te_object *held = NULL;
+	te_object *callee;
+	te_lambda_data *lambda;
+	te_continuation *record;
+	int base = te->calls.count;
+	int count;
+
+	te->env = frame;
+	stack = te_stack_alloc(te, sizeof(te_value) * (code->stack_size + 1));
+
+	sp = stack;
+	pc = code->op;
+
+	te->calls.nested++;
+
+	if (te_depth_exceeded(te, 0))
+		goto error;
+
+	TE_VM_SWITCH()
+	{
+		TE_VM_CASE(NIL)
+		{
+			*sp++ = TE_VALUE_NIL;
+			TE_VM_NEXT();
+		}
+
+		TE_VM_CASE(TRUE)
+		{
+			*sp++ = TE_VALUE_TRUE;
+			TE_VM_NEXT();
+		}
+
+		TE_VM_CASE(FALSE)
+		{
+			*sp++ = TE_VALUE_FALSE;
+			TE_VM_NEXT();
+		}
+
+		TE_VM_CASE(CONSTANT)
+		{
+			*sp++ = te_value_retain(code->constant[*pc++]);
+			TE_VM_NEXT();
+		}
+
+		TE_VM_CASE(LOCAL)
+		{
+			te_value value = te_frame(te->env, pc[0])->slot[pc[1]];
+
+			if (value == TE_VALUE_UNBOUND)
+			{
+				te_set_error(te, "eval: unbound symbol");
+				goto error;
+			}
+
+			*sp++ = te_value_retain(value);
+			pc += 2;
+			TE_VM_NEXT();
+		}
+
+		TE_VM_CASE(GLOBAL)
+		{
+			te_value value = code->global[*pc++]->value;
+
+			if (value == TE_VALUE_UNBOUND)
+			{
+				te_set_error(te, "eval: unbound symbol");
+				goto error;
+			}
+
+			*sp++ = te_value_retain(value);
+			TE_VM_NEXT();
+		}
+
+		TE_VM_CASE(DEFINE_LOCAL)
+		{
+			te_value *slot = &te->env->slot[*pc++];
+
+			te_value_release(*slot);
+			*slot = te_value_retain(sp[-1]);
+			TE_VM_NEXT();
+		}
+
+		TE_VM_CASE(DEFINE_GLOBAL)
+		{
+			te_symbol *s = code->global[*pc++];
+
+			if (te->region.active)
+			{
+				te_set_error(te, "define: global definition in region evaluation");
+				goto error;
+			}
+
+			te_value_release(s->value);
+			s->value = te_value_retain(sp[-1]);
+			te->global_version++;
+			TE_VM_NEXT();
+		}
+
+		TE_VM_CASE(TEMP)
+		{
+			*sp++ = te_value_retain(stack[*pc++]);
+			TE_VM_NEXT();
+		}
+
+		TE_VM_CASE(TEMP_SET)
+		{
+			te_value *slot = &stack[*pc++];
+
+			te_value_release(*slot);
+			*slot = te_value_retain(sp[-1]);
+			TE_VM_NEXT();
+		}
+
+		TE_VM_CASE(LAMBDA)
+		{
+			*sp++ = te_value_box(te_make_lambda(te, code->lambda[*pc++]));
+			TE_VM_NEXT();
+		}
+
+		TE_VM_CASE(POP)
+		{
+			te_value_release(*--sp);
+			TE_VM_NEXT();
+		}
+
+		TE_VM_CASE(JUMP)
+		{
+			pc = code->op + *pc;
+			TE_VM_NEXT();
+		}
+
+		TE_VM_CASE(JUMP_FALSE)
+		{
+			te_value cond = *--sp;
+
+			if (!TE_VALUE_IS_BOOLEAN(cond))
+			{
+				te_value_release(cond);
+				te_set_error(te, te_message[pc[1]]);
+				goto error;
+			}
+
+			pc = TE_VALUE_BOOLEAN(cond) ? pc + 2 : code->op + *pc;
+			TE_VM_NEXT();
+		}
+
+		TE_VM_CASE(JUMP_TRUE)
+		{
+			te_value cond = *--sp;
+
+			if (!TE_VALUE_IS_BOOLEAN(cond))
+			{
+				te_value_release(cond);
+				te_set_error(te, te_message[pc[1]]);
+				goto error;
+			}
+
+			pc = TE_VALUE_BOOLEAN(cond) ? code->op + *pc : pc + 2;
+			TE_VM_NEXT();
+		}
+
+		/* Jumps to the unoptimized form once a builtin is redefined. */
+		TE_VM_CASE(GUARD)
+		{
+			if (code->global[pc[0]]->value != code->constant[pc[1]])
+				pc = code->op + pc[2];
+			else
+				pc += 3;
+
+			TE_VM_NEXT();
+		}
+
+		TE_VM_CASE(INLINE_GLOBAL)
+		{
+			if (te_lambda_function(code->global[pc[0]]->value) != code->lambda[pc[1]])
+				pc = code->op + pc[2];
+			else
+				pc += 3;
+
+			TE_VM_NEXT();
+		}
+
+		TE_VM_CASE(INLINE_LOCAL)
+		{
+			if (te_lambda_function(te_frame(te->env, pc[0])->slot[pc[1]]) != code->lambda[pc[2]])
+				pc = code->op + pc[3];
+			else
+				pc += 4;
+
+			TE_VM_NEXT();
+		}
+
+		TE_VM_CASE(CALL)
+		{
+			te_value fun = *--sp;
+
+			count = *pc++;
+
+			if (te_value_type(fun) != TE_TYPE_PROCEDURE)
+			{
+				te_value_release(fun);
+				te_set_error(te, "apply: can't eval operator");
+				goto error;
+			}
+
+			callee = TE_VALUE_OBJECT(fun);
+			goto call;
+		}
+
+		TE_VM_CASE(CALL_LOCAL)
+		{
+			callee = te_operator(te, te_frame(te->env, pc[0])->slot[pc[1]]);
+			count = pc[2];
+			pc += 3;
+
+			if (!callee)
+				goto error;
+
+			te_object_retain(callee);
+			goto call;
+		}
+
+		TE_VM_CASE(CALL_GLOBAL)
+		{
+			te_cache *cache = &code->cache[pc[0]];
+
+			count = pc[1];
+			pc += 2;
+
+			if (cache->version != te->global_version && !te_cache_update(te, cache))
+				goto error;
+
+			if (cache->native == te_lambda_native)
+			{
+				callee = te_object_retain(cache->procedure);
+				goto call;
+			}
+			else
+			{
+				te_value value;
+
+				te_object_retain(cache->procedure);
+
+				if (cache->native)
+					value = cache->native(te, cache->user, sp - count, count);
+				else
+					value = te_call_host(te, cache->procedure->data.procedure, sp - count, count);
+
+				te_object_release(cache->procedure);
+
+				for (; count > 0; count--)
+					te_value_release(*--sp);
+
+				*sp++ = value;
+
+				if (te_error(te))
+					goto error;
+			}
+
+			TE_VM_NEXT();
+		}
+
+		TE_VM_CASE(TAIL_CALL)
+		{
+			te_value fun = *--sp;
+
+			count = *pc;
+
+			if (te_value_type(fun) != TE_TYPE_PROCEDURE)
+			{
+				te_value_release(fun);
+				te_set_error(te, "apply: can't eval operator");
+				goto error;
+			}
+
+			callee = TE_VALUE_OBJECT(fun);
+			goto tail_call;
+		}
+
+		TE_VM_CASE(TAIL_CALL_LOCAL)
+		{
+			callee = te_operator(te, te_frame(te->env, pc[0])->slot[pc[1]]);
+			count = pc[2];
+
+			if (!callee)
+				goto error;
+
+			te_object_retain(callee);
+			goto tail_call;
+		}
+
+		TE_VM_CASE(TAIL_CALL_GLOBAL)
+		{
+			te_cache *cache = &code->cache[pc[0]];
+
+			count = pc[1];
+
+			if (cache->version != te->global_version && !te_cache_update(te, cache))
+				goto error;
+
+			callee = te_object_retain(cache->procedure);
+			goto tail_call;
+		}
+
+		TE_VM_CASE(ERROR)
+		{
+			te_set_error(te, te_message[*pc]);
+			goto error;
+		}
+
+		TE_VM_CASE(RETURN)
+		{
+			result = *--sp;
+			goto leave;
+		}
+
+		/*
+		 * Calls callee, retained, with the count operands on top of the
+		 * value stack. A lambda runs in place of the caller, which is
+		 * saved to pick up again at its RETURN.
+		 */
+	call:
+		if (!te_is_lambda(callee))
+		{
+			te_value value = te_apply(te, callee, sp - count, count);
+
+			te_object_release(callee);
+
+			for (; count > 0; count--)
+				te_value_release(*--sp);
+
+			*sp++ = value;
+
+			if (te_error(te))
+				goto error;
+
+			TE_VM_NEXT();
+		}
+
+		lambda = callee->data.procedure->user;
+
+		if (te_depth_exceeded(te, 1) || !te_frame_check(te, lambda, count))
+		{
+			te_object_release(callee);
+			goto error;
+		}
+
+		/* Native code only takes numbers, which need no releasing. */
+		if (te_jit_enter(te, lambda->function, sp - count, count, &result))
+		{
+			te_object_release(callee);
+			sp -= count;
+			*sp++ = result;
+			result = TE_VALUE_NIL;
+			TE_VM_NEXT();
+		}
+
+		sp -= count;
+
+		record = te_continuation_push(te);
+		record->code = code;
+		record->pc = pc;
+		record->stack = stack;
+		record->sp = sp;
+		record->env = te->env;
+		record->held = held;
+
+		te->env = te_frame_enter(te, lambda, sp, count);
+		held = callee;
+		goto enter;
+
+		/*
+		 * A lambda called from tail position replaces the running one,
+		 * its frame and its window, once the operands are moved aside.
+		 * Anything else is called here, and what it returns returned.
+		 */
+	tail_call:
+		if (!te_is_lambda(callee))
+		{
+			result = te_apply(te, callee, sp - count, count);
+			te_object_release(callee);
+
+			for (; count > 0; count--)
+				te_value_release(*--sp);
+
+			if (te_error(te))
+			{
+				te_value_release(result);
+				result = TE_VALUE_NIL;
+				goto error;
+			}
+
+			goto leave;
+		}
+
+		lambda = callee->data.procedure->user;
+
+		if (!te_frame_check(te, lambda, count))
+		{
+			te_object_release(callee);
+			goto error;
+		}
+
+		if (te_jit_enter(te, lambda->function, sp - count, count, &result))
+		{
+			te_object_release(callee);
+			sp -= count;
+			goto leave;
+		}
+
+		sp -= count;
+		te_tail_set(te, sp, count);
+
+		while (sp > stack)
+			te_value_release(*--sp);
+
+		te_stack_free(te, stack);
+		te_frame_leave(te, te->env);
+		te_object_release(held);
+
+		te->env = te_frame_enter(te, lambda, te->tail.operand, count);
+		held = callee;
+
+	enter:
+		code = lambda->function->code;
+		stack = te_stack_alloc(te, sizeof(te_value) * (code->stack_size + 1));
+		sp = stack;
+		pc = code->op;
+		TE_VM_NEXT();
+
+		/*
+		 * Returns result to the caller saved last, if it ran here. The
+		 * temps are all that is left on the value stack.
+		 */
+	leave:
+		while (sp > stack)
+			te_value_release(*--sp);
+
+		te_stack_free(te, stack);
+
+		if (te->calls.count == base)
+		{
+			te->calls.nested--;
+			goto done;
+		}
+
+		te_frame_leave(te, te->env);
+		te_object_release(held);
+
+		record = &te->calls.record[--te->calls.count];
+		code = record->code;
+		pc = record->pc;
+		stack = record->stack;
+		sp = record->sp;
+		te->env = record->env;
+		held = record->held;
+
+		*sp++ = result;
+		result = TE_VALUE_NIL;
+
+		if (te_error(te))
+			goto error;
+
+		TE_VM_NEXT();
+	}
+
+	/* Unwinds every call made here, down to the code first run. */
+error:
+	for (;;)
+	{
+		while (sp > stack)
+			te_value_release(*--sp);
+
+		te_stack_free(te, stack);
+
+		if (te->calls.count == base)
+		{
+			te->calls.nested--;
+			break;
+		}
+
+		te_frame_leave(te, te->env);
+		te_object_release(held);
+
+		record = &te->calls.record[--te->calls.count];
+		code = record->code;
+		stack = record->stack;
+		sp = record->sp;
+		te->env = record->env;
+		held = record->held;
+	}
+
+done:
+	if (te->env)
+		te_frame_leave(te, te->env);
+
+	te_object_release(held);
+	te->env = prev;
+
+	return result;
+}
+
+/*
+ * Programs are compiled against the top level, so they run outside
+ * any lambda frame, even when evaluated from inside a procedure. A run
+ * that fails returns NULL, one that gives nil the nil object.
+ */
+te_object* te_run(tiny_eval *te, te_program *program)
+{
+	tiny_eval *current;
+	te_object *result;
+	te_value value;
+
+	assert(te);
+	assert(program);
+
+	te_set_error(te, NULL);
+
+	if (te_current != te && te->gc.enabled && te->gc.count >= te->gc.threshold)
+		te_gc_collect(te);
+
+	current = te_current;
+	te_current = te;
+
+	value = te_execute(te, program->code, NULL);
+	result = te_error(te) ? NULL : te_value_to_object(value);
+	te_value_release(value);
+
+	if (current != te && (te->error || te->pool->limit))
+		te_calls_trim(te);
+
+	te_current = current;
+
+	return result;
+}
+
+te_object* te_eval(tiny_eval *te, const char *expression)
+{
+	te_program *program;
+	te_object *result = NULL;
+
+	assert(te);
+
+	program = te_compile(te, expression);
+
+	if (program)
+	{
+		result = te_run(te, program);
+		te_program_release(program);
+	}
+
+	return result;
+}
+
+/*
+ * Evaluates expression with every object it makes, the result included,
+ * carved from the region. They stay valid until te_region_reset, and
+ * need not be released. Global definitions would outlive the region, so
+ * they are errors here.
+ */
+te_object* te_eval_region(tiny_eval *te, const char *expression)
+{
+	te_object *result;
+	int active;
+
+	assert(te);
+
+	active = te->region.active;
+	te->region.active = 1;
+	result = te_eval(te, expression);
+	te->region.active = active;
+
+	if (result && result->ref != TE_REF_IMMORTAL)
+		te_region_keep(&te->region, result);
+
+	return result;
+}
+
+void te_region_reset(tiny_eval *te)
+{
+	te_region *region = &te->region;
+	te_stack_block *block;
+	int i;
+
+	assert(te);
+	assert(!region->active);
+
+	for (i = 0; i < region->final_count; i++)
+	{
+		te_object *object = region->final[i];
+
+		if (object->ref == TE_REF_IMMORTAL)
+			te_lambda_release(object->data.procedure->user);
+		else
+			te_object_release(object);
+	}
+
+	region->final_count = 0;
+
+	if (region->block)
+	{
+		while ((block = region->block->next) != NULL)
+		{
+			region->block->next = block->next;
+			te_free(block);
+		}
+
+		region->block->top = 0;
+	}
+}
+
+const char *te_error(tiny_eval *te)
+{
+	assert(te);
+	return te->error;
+}
+
+void te_stats_get(tiny_eval *te, te_stats *stats)
+{
+	assert(te);
+	assert(stats);
+
+	*stats = te->pool->stats;
+	stats->collections = te->gc.collections;
+}
+
+/* Zero lifts the limit. */
+void te_set_memory_limit(tiny_eval *te, unsigned long limit)
+{
+	assert(te);
+	te->pool->limit = limit;
+}
+
+/* Caps how deep calls to lambdas may nest; zero lifts the cap. */
+void te_set_max_depth(tiny_eval *te, int depth)
+{
+	assert(te);
+	te->calls.limit = depth;
+}
+
+void te_set_error(tiny_eval *te, const char *str)
+{
+	assert(te);
+
+	if (te->error)
+	{
+		te_free(te->error);
+		te->error = NULL;
+	}
+
+	if (str)
+	{
+		te->error = te_str_copy(str);
+	}
+}
+
+/* Calls a lambda from outside the evaluator, or from another procedure. */
+TE_NATIVE(te_lambda_native)
+{
+	te_lambda_data *lambda = user;
+	te_value result;
+	int i;
+
+	assert(te);
+	assert(user);
+
+	if (!te_frame_check(te, lambda, count))
+		return TE_VALUE_NIL;
+
+	if (te_jit_enter(te, lambda->function, operands, count, &result))
+		return result;
+
+	for (i = 0; i < count; i++)
+		te_value_retain(operands[i]);
+
+	return te_execute(te, lambda->function->code, te_frame_enter(te, lambda, operands, count));
+}
+
+static double te_extract_number(tiny_eval *te, te_value value, te_type *type)
+{
+	assert(te);
+	assert(type);
+
+	*type = te_value_type(value);
+
+	if (*type == TE_TYPE_INTEGER || *type == TE_TYPE_NUMBER)
+	{
+		return te_value_number(value);
+	}
+	else
+	{
+		te_set_error(te, "operand is not a number");
+	}
+
+	return 0;
+}
+
+static te_value te_result_from_number(tiny_eval *te, double value, te_type type)
+{
+	te_value result = TE_VALUE_NIL;
+
+	assert(te);
+
+	if (!te_error(te))
+	{
+		if (type == TE_TYPE_INTEGER)
+		{
+			return te_value_from_integer((te_int64)value);
+		}
+		else if (type == TE_TYPE_NUMBER)
+		{
+			return te_value_from_number(value);
+		}
+	}
+
+	return result;
+}
+
+/*
+ * Integer kernels. They report whether the exact result fits in 64
+ * bits; when it does not, the caller redoes the operation in double.
+ */
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__))
+#define te_int64_add(a, b, out) (!__builtin_add_overflow(a, b, out))
+#define te_int64_sub(a, b, out) (!__builtin_sub_overflow(a, b, out))
+#define te_int64_mul(a, b, out) (!__builtin_mul_overflow(a, b, out))
+#else
+static int te_int64_add(te_int64 a, te_int64 b, te_int64 *out)
+{
+	if ((b > 0 && a > TE_INT64_MAX - b) || (b < 0 && a < TE_INT64_MIN - b))
+		return 0;
+
+	*out = a + b;
+	return 1;
+}
+
+static int te_int64_sub(te_int64 a, te_int64 b, te_int64 *out)
+{
+	if ((b < 0 && a > TE_INT64_MAX + b) || (b > 0 && a < TE_INT64_MIN + b))
+		return 0;
+
+	*out = a - b;
+	return 1;
+}
+
+static int te_int64_mul(te_int64 a, te_int64 b, te_int64 *out)
+{
+	if (a > 0)
+	{
+		if (b > 0 ? a > TE_INT64_MAX / b : b < TE_INT64_MIN / a)
+			return 0;
+	}
+	else if (a < 0)
+	{
+		if (b > 0 ? a < TE_INT64_MIN / b : b < TE_INT64_MAX / a)
+			return 0;
+	}
+
+	*out = a * b;
+	return 1;
+}
+#endif
+
+#define TE_ARITH_ADD 0
+#define TE_ARITH_SUB 1
+#define TE_ARITH_MUL 2
+
+/*
+ * A running result. It stays an exact integer until a double operand or
+ * an overflow turns it into a double for the rest of the fold.
+ */
+typedef struct tag_te_accum
+{
+	int exact;
+	te_int64 integer;
+	double number;
+}
+te_accum;
+
+static void te_accum_init(tiny_eval *te, te_accum *accum, te_value value)
+{
+	accum->exact = 1;
+	accum->integer = 0;
+	accum->number = 0;
+
+	switch (te_value_type(value))
+	{
+	case TE_TYPE_INTEGER:
+		accum->integer = te_value_integer(value);
+		break;
+
+	case TE_TYPE_NUMBER:
+		accum->exact = 0;
+		accum->number = te_value_number(value);
+		break;
+
+	default:
+		te_set_error(te, "operand is not a number");
+		break;
+	}
+}
+
+static void te_accum_apply(tiny_eval *te, te_accum *accum, int op, te_value value)
+{
+	te_type type = te_value_type(value);
+	double number;
+
+	if (type == TE_TYPE_INTEGER && accum->exact)
+	{
+		te_int64 operand = te_value_integer(value);
+		te_int64 result;
+		int fits;
+
+		switch (op)
+		{
+		case TE_ARITH_ADD:
+			fits = te_int64_add(accum->integer, operand, &result);
+			break;
+
+		case TE_ARITH_SUB:
+			fits = te_int64_sub(accum->integer, operand, &result);
+			break;
+
+		default:
+			fits = te_int64_mul(accum->integer, operand, &result);
+			break;
+		}
+
+		if (fits)
+		{
+			accum->integer = result;
+			return;
+		}
+	}
+	else if (type != TE_TYPE_INTEGER && type != TE_TYPE_NUMBER)
+	{
+		te_set_error(te, "operand is not a number");
+		return;
+	}
+
+	if (accum->exact)
+	{
+		accum->exact = 0;
+		accum->number = (double)accum->integer;
+	}
+
+	number = te_value_number(value);
+
+	switch (op)
+	{
+	case TE_ARITH_ADD:
+		accum->number += number;
+		break;
+
+	case TE_ARITH_SUB:
+		accum->number -= number;
+		break;
+
+	default:
+		accum->number *= number;
+		break;
+	}
+}
+
+static te_value te_accum_result(tiny_eval *te, te_accum *accum)
+{
+	if (te_error(te))
+		return TE_VALUE_NIL;
+
+	if (accum->exact)
+		return te_value_from_integer(accum->integer);
+
+	return te_value_from_number(accum->number);
+}
+
+static te_value te_arith_fold(tiny_eval *te, int op, te_value init, te_value operands[], int count)
+{
+	te_accum accum;
+	int i;
+
+	te_accum_init(te, &accum, init);
+
+	for (i = 0; i < count && !te_error(te); i++)
+		te_accum_apply(te, &accum, op, operands[i]);
+
+	return te_accum_result(te, &accum);
+}
+
+/*
+ * Two-operand entry points. Both inline integers are at most 48 bits,
+ * so their sum and difference cannot overflow and skip the fold.
+ */
+static te_value te_plus2(tiny_eval *te, te_value one, te_value two)
+{
+	if (TE_VALUE_TAG(one) == TE_TAG_INTEGER && TE_VALUE_TAG(two) == TE_TAG_INTEGER)
+		return te_value_from_integer(te_value_integer(one) + te_value_integer(two));
+
+	return te_arith_fold(te, TE_ARITH_ADD, one, &two, 1);
+}
+
+static te_value te_minus2(tiny_eval *te, te_value one, te_value two)
+{
+	if (TE_VALUE_TAG(one) == TE_TAG_INTEGER && TE_VALUE_TAG(two) == TE_TAG_INTEGER)
+		return te_value_from_integer(te_value_integer(one) - te_value_integer(two));
+
+	return te_arith_fold(te, TE_ARITH_SUB, one, &two, 1);
+}
+
+static te_value te_multiplies2(tiny_eval *te, te_value one, te_value two)
+{
+	te_int64 result;
+
+	if (TE_VALUE_TAG(one) == TE_TAG_INTEGER && TE_VALUE_TAG(two) == TE_TAG_INTEGER &&
+		te_int64_mul(te_value_integer(one), te_value_integer(two), &result))
+		return te_value_from_integer(result);
+
+	return te_arith_fold(te, TE_ARITH_MUL, one, &two, 1);
+}
+
+/* Negates value exactly, leaving zero with the opposite sign. */
+static te_value te_negate(tiny_eval *te, te_value value)
+{
+	te_int64 result;
+
+	switch (te_value_type(value))
+	{
+	case TE_TYPE_INTEGER:
+		if (te_int64_sub(0, te_value_integer(value), &result))
+			return te_value_from_integer(result);
+
+		return te_value_from_number(-(double)te_value_integer(value));
+
+	case TE_TYPE_NUMBER:
+		return te_value_from_number(-te_value_number(value));
+
+	default:
+		te_set_error(te, "operand is not a number");
+		return TE_VALUE_NIL;
+	}
+}
+
+TE_NATIVE(te_plus)
+{
+	UNUSED(user);
+
+	if (count == 2)
+		return te_plus2(te, operands[0], operands[1]);
+
+	/* Summed from the first operand, as -0.0 plus -0.0 is -0.0. */
+	if (count > 0)
+		return te_arith_fold(te, TE_ARITH_ADD, operands[0], operands + 1, count - 1);
+
+	return te_value_from_integer(0);
+}
+
+TE_NATIVE(te_minus)
+{
+	te_value result = TE_VALUE_NIL;
+
+	UNUSED(user);
+
+	if (count == 2)
+	{
+		result = te_minus2(te, operands[0], operands[1]);
+	}
+	else if (count == 1)
+	{
+		result = te_negate(te, operands[0]);
+	}
+	else if (count > 1)
+	{
+		result = te_arith_fold(te, TE_ARITH_SUB, operands[0], operands + 1, count - 1);
+	}
+	else
+	{
+		te_set_error(te, "minus: require at least 1 operand");
+	}
+
+	return result;
+}
+
+TE_NATIVE(te_multiplies)
+{
+	UNUSED(user);
+
+	if (count == 2)
+		return te_multiplies2(te, operands[0], operands[1]);
+
+	return te_arith_fold(te, TE_ARITH_MUL, te_value_from_integer(1), operands, count);
+}
+
+TE_NATIVE(te_divides)
+{
+	te_value result = TE_VALUE_NIL;
+	double value = 1;
+
+	UNUSED(user);
+	
+	if (count == 1)
+	{
+		te_type operand_type;
+		value /= te_extract_number(te, operands[0], &operand_type);
+		result = te_result_from_number(te, value, TE_TYPE_NUMBER);
+	}
+	else if (count > 1)
+	{
+		int i;
+		te_type operand_type;
+
+		value = te_extract_number(te, operands[0], &operand_type);
+
+		for (i = 1; i < count && !te_error(te); i++)
+			value /= te_extract_number(te, operands[i], &operand_type);
+
+		result = te_result_from_number(te, value, TE_TYPE_NUMBER);
+	}
+	else
+	{
+		te_set_error(te, "divides: require at least 1 operand");
+	}
+
+	return result;
+}
 
-	*type = te_object_type(object);
-	
-	if (*type == TE_TYPE_INTEGER)
+static TE_NATIVE(te_not)
+{
+	te_value result = TE_VALUE_NIL;
+
+	UNUSED(user);
+
+	if (count == 1)
 	{
-		return te_to_integer(object);
+		int value = 0;
+		if (TE_VALUE_IS_BOOLEAN(operands[0]))
+			value = !TE_VALUE_BOOLEAN(operands[0]);
+
+		result = TE_VALUE_FROM_BOOLEAN(value);
+	}
+	else
+	{
+		te_set_error(te, "not: requires exactly 1 operand");
 	}
-	else if (*type == TE_TYPE_NUMBER)
+
+	return result;
+}
+
+/*
+ * Compares two checked numbers with op. Two integers compare exactly; a
+ * mixed pair compares as doubles.
+ */
+#define TE_COMPARE_PAIR(one, two, op) \
+	(te_value_type(one) == TE_TYPE_INTEGER && te_value_type(two) == TE_TYPE_INTEGER ? \
+		te_value_integer(one) op te_value_integer(two) : \
+		te_value_number(one) op te_value_number(two))
+
+static int te_compare_check(tiny_eval *te, te_value value)
+{
+	te_type type = te_value_type(value);
+
+	if (type == TE_TYPE_NUMBER || type == TE_TYPE_INTEGER)
+		return 1;
+
+	te_set_error(te, "operand is not a number");
+	return 0;
+}
+
+#define TE_COMPARE_PROC(name,op) \
+static TE_NATIVE(name) \
+{ \
+	te_value result = TE_VALUE_NIL; \
+\
+	UNUSED(user);\
+\
+	if (count == 2 && TE_VALUE_TAG(operands[0]) == TE_TAG_INTEGER && \
+		TE_VALUE_TAG(operands[1]) == TE_TAG_INTEGER) \
+	{ \
+		result = TE_VALUE_FROM_BOOLEAN(te_value_integer(operands[0]) op te_value_integer(operands[1])); \
+	} \
+	else if (count == 1) \
+	{ \
+		if (te_compare_check(te, operands[0])) \
+			result = TE_VALUE_TRUE; \
+	} \
+	else if (count > 1) \
+	{ \
+		int i; \
+		int op_result = 1; \
+\
+		for (i = 1; op_result && i < count && !te_error(te); i++) \
+		{ \
+			if (te_compare_check(te, operands[i - 1]) && te_compare_check(te, operands[i])) \
+				op_result = TE_COMPARE_PAIR(operands[i - 1], operands[i], op); \
+		} \
+\
+		if (!te_error(te)) \
+			result = TE_VALUE_FROM_BOOLEAN(op_result); \
+	} \
+	else \
+	{ \
+		result = TE_VALUE_TRUE; \
+	} \
+\
+	return result; \
+}
+
+TE_COMPARE_PROC(te_equal, ==)
+TE_COMPARE_PROC(te_lesser, <)
+TE_COMPARE_PROC(te_lesser_equal, <=)
+TE_COMPARE_PROC(te_greater, >)
+TE_COMPARE_PROC(te_greater_equal, >=)
+
+static TE_NATIVE(te_display)
+{
+	UNUSED(user);
+
+	if (count == 1)
 	{
-		return te_to_number(object);
+		te_type type = te_value_type(operands[0]);
+
+		switch (type)
+		{
+		case TE_TYPE_NIL:
+			printf("#!unspecific");
+			break;
+
+		case TE_TYPE_PROCEDURE:
+			printf("#[compound-procedure]");
+			break;
+
+		case TE_TYPE_USERDATA:
+			printf("#[user-data]");
+			break;
+
+		case TE_TYPE_INTEGER:
+			printf(TE_INT64_FORMAT, te_value_integer(operands[0]));
+			break;
+
+		case TE_TYPE_NUMBER:
+			printf("%g", te_value_number(operands[0]));
+			break;
+
+		case TE_TYPE_STRING:
+			printf("%s", te_to_string(TE_VALUE_OBJECT(operands[0])));
+			break;
+
+		case TE_TYPE_BOOLEAN:
+			if (TE_VALUE_BOOLEAN(operands[0]) == 0)
+				printf("#f");
+			else
+				printf("#t");
+			break;
+
+		default:
+			printf("#!unspecific");
+			break;
+		}
 	}
 	else
 	{
-		te_set_error(te, "operand is not a number");
+		te_set_error(te, "display: requires 1 operand");
+	}
+
+	return TE_VALUE_NIL;
+}
+
+static TE_NATIVE(te_newline)
+{
+	UNUSED(te);
+	UNUSED(user);
+	UNUSED(operands);
+	UNUSED(count);
+
+	printf("\n");
+	return TE_VALUE_NIL;
+}
+
+/*
+ * Batch evaluation. A program of one expression over the columns,
+ * constants, numeric globals and the arithmetic, comparison and logic
+ * builtins is planned into steps, each running one kernel over a chunk
+ * of rows. Every intermediate result is a lane of TE_BATCH_CHUNK
+ * values. Anything else, and any chunk whose integers overflow, runs
+ * row by row through the compiled code with the columns bound as
+ * globals.
+ */
+#define TE_BATCH_CHUNK 256
+
+#define TE_BATCH_TO_NUMBER 0
+#define TE_BATCH_ADD       1
+#define TE_BATCH_SUB       2
+#define TE_BATCH_MUL       3
+#define TE_BATCH_DIV       4
+#define TE_BATCH_EQ        5
+#define TE_BATCH_LT        6
+#define TE_BATCH_LE        7
+#define TE_BATCH_GT        8
+#define TE_BATCH_GE        9
+#define TE_BATCH_NOT       10
+#define TE_BATCH_AND       11
+#define TE_BATCH_OR        12
+#define TE_BATCH_SELECT    13
+
+/*
+ * Lane i reads column i for i below column_count; the others hold
+ * their own data.
+ */
+typedef struct tag_te_lane
+{
+	te_type type;
+	void *data;
+}
+te_lane;
+
+typedef struct tag_te_step
+{
+	int op;
+	int out;
+	int one;
+	int two;
+	int three;
+}
+te_step;
+
+typedef struct tag_te_batch
+{
+	tiny_eval *te;
+	const te_column *column;
+	te_name **name;
+	int column_count;
+	te_lane *lane;
+	int lane_count;
+	int lane_cap;
+	te_step *step;
+	int step_count;
+	int step_cap;
+}
+te_batch;
+
+static void te_kernel_to_number(double *out, const te_int64 *one, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		out[i] = (double)one[i];
+}
+
+/* The integer kernels return 0 when a row overflows. */
+static int te_kernel_add_integer(te_int64 *out, const te_int64 *one, const te_int64 *two, int n)
+{
+	te_int64 overflow = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		te_int64 sum = (te_int64)((te_value)one[i] + (te_value)two[i]);
+
+		overflow |= (one[i] ^ sum) & (two[i] ^ sum);
+		out[i] = sum;
+	}
+
+	return overflow >= 0;
+}
+
+static int te_kernel_sub_integer(te_int64 *out, const te_int64 *one, const te_int64 *two, int n)
+{
+	te_int64 overflow = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		te_int64 difference = (te_int64)((te_value)one[i] - (te_value)two[i]);
+
+		overflow |= (one[i] ^ two[i]) & (one[i] ^ difference);
+		out[i] = difference;
+	}
+
+	return overflow >= 0;
+}
+
+static int te_kernel_mul_integer(te_int64 *out, const te_int64 *one, const te_int64 *two, int n)
+{
+	int fits = 1;
+	int i;
+
+	for (i = 0; i < n; i++)
+		fits &= te_int64_mul(one[i], two[i], &out[i]);
+
+	return fits;
+}
+
+#define TE_KERNEL_NUMBER(name, op) \
+static void name(double *out, const double *one, const double *two, int n) \
+{ \
+	int i; \
+\
+	for (i = 0; i < n; i++) \
+		out[i] = one[i] op two[i]; \
+}
+
+TE_KERNEL_NUMBER(te_kernel_add_number, +)
+TE_KERNEL_NUMBER(te_kernel_sub_number, -)
+TE_KERNEL_NUMBER(te_kernel_mul_number, *)
+TE_KERNEL_NUMBER(te_kernel_div_number, /)
+
+#define TE_KERNEL_COMPARE(name, type, op) \
+static void name(unsigned char *out, const type *one, const type *two, int n) \
+{ \
+	int i; \
+\
+	for (i = 0; i < n; i++) \
+		out[i] = (unsigned char)(one[i] op two[i]); \
+}
+
+TE_KERNEL_COMPARE(te_kernel_eq_integer, te_int64, ==)
+TE_KERNEL_COMPARE(te_kernel_lt_integer, te_int64, <)
+TE_KERNEL_COMPARE(te_kernel_le_integer, te_int64, <=)
+TE_KERNEL_COMPARE(te_kernel_gt_integer, te_int64, >)
+TE_KERNEL_COMPARE(te_kernel_ge_integer, te_int64, >=)
+TE_KERNEL_COMPARE(te_kernel_eq_number, double, ==)
+TE_KERNEL_COMPARE(te_kernel_lt_number, double, <)
+TE_KERNEL_COMPARE(te_kernel_le_number, double, <=)
+TE_KERNEL_COMPARE(te_kernel_gt_number, double, >)
+TE_KERNEL_COMPARE(te_kernel_ge_number, double, >=)
+TE_KERNEL_COMPARE(te_kernel_and, unsigned char, &)
+TE_KERNEL_COMPARE(te_kernel_or, unsigned char, |)
+
+/* Indexed by op - TE_BATCH_EQ. */
+static void (*const te_kernel_compare_integer[])(unsigned char*, const te_int64*, const te_int64*, int) =
+{
+	te_kernel_eq_integer,
+	te_kernel_lt_integer,
+	te_kernel_le_integer,
+	te_kernel_gt_integer,
+	te_kernel_ge_integer
+};
+
+static void (*const te_kernel_compare_number[])(unsigned char*, const double*, const double*, int) =
+{
+	te_kernel_eq_number,
+	te_kernel_lt_number,
+	te_kernel_le_number,
+	te_kernel_gt_number,
+	te_kernel_ge_number
+};
+
+static void te_kernel_not(unsigned char *out, const unsigned char *one, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		out[i] = (unsigned char)!one[i];
+}
+
+#define TE_KERNEL_SELECT(name, type) \
+static void name(type *out, const unsigned char *cond, const type *one, const type *two, int n) \
+{ \
+	int i; \
+\
+	for (i = 0; i < n; i++) \
+		out[i] = cond[i] ? one[i] : two[i]; \
+}
+
+TE_KERNEL_SELECT(te_kernel_select_integer, te_int64)
+TE_KERNEL_SELECT(te_kernel_select_number, double)
+TE_KERNEL_SELECT(te_kernel_select_boolean, unsigned char)
+
+static int te_batch_type(te_type type)
+{
+	return type == TE_TYPE_INTEGER || type == TE_TYPE_NUMBER || type == TE_TYPE_BOOLEAN;
+}
+
+static size_t te_batch_size(te_type type)
+{
+	if (type == TE_TYPE_INTEGER)
+		return sizeof(te_int64);
+
+	if (type == TE_TYPE_NUMBER)
+		return sizeof(double);
+
+	return sizeof(unsigned char);
+}
+
+static int te_batch_lane(te_batch *batch, te_type type, int owned)
+{
+	te_lane *lane;
+
+	if (batch->lane_count >= batch->lane_cap)
+	{
+		batch->lane_cap = batch->lane_cap ? batch->lane_cap * 2 : 16;
+		batch->lane = te_realloc(batch->lane, sizeof(te_lane) * batch->lane_cap);
+		assert(batch->lane);
+	}
+
+	lane = &batch->lane[batch->lane_count];
+	lane->type = type;
+	lane->data = NULL;
+
+	if (owned)
+	{
+		lane->data = te_alloc(te_batch_size(type) * TE_BATCH_CHUNK);
+		assert(lane->data);
+	}
+
+	return batch->lane_count++;
+}
+
+static void te_batch_init(te_batch *batch, tiny_eval *te, const te_column columns[], int count)
+{
+	int i;
+
+	batch->te = te;
+	batch->column = columns;
+	batch->column_count = count;
+	batch->lane = NULL;
+	batch->lane_count = 0;
+	batch->lane_cap = 0;
+	batch->step = NULL;
+	batch->step_count = 0;
+	batch->step_cap = 0;
+
+	batch->name = te_alloc(sizeof(te_name*) * (count + 1));
+	assert(batch->name);
+
+	for (i = 0; i < count; i++)
+	{
+		batch->name[i] = te_intern(te, columns[i].name, columns[i].name + strlen(columns[i].name));
+		te_batch_lane(batch, columns[i].type, 0);
+	}
+}
+
+static void te_batch_release(te_batch *batch)
+{
+	int i;
+
+	for (i = batch->column_count; i < batch->lane_count; i++)
+		te_free(batch->lane[i].data);
+
+	te_free(batch->lane);
+	te_free(batch->step);
+	te_free(batch->name);
+}
+
+static int te_batch_integer(te_batch *batch, te_int64 value)
+{
+	int lane = te_batch_lane(batch, TE_TYPE_INTEGER, 1);
+	te_int64 *data = batch->lane[lane].data;
+	int i;
+
+	for (i = 0; i < TE_BATCH_CHUNK; data[i++] = value);
+	return lane;
+}
+
+static int te_batch_number(te_batch *batch, double value)
+{
+	int lane = te_batch_lane(batch, TE_TYPE_NUMBER, 1);
+	double *data = batch->lane[lane].data;
+	int i;
+
+	for (i = 0; i < TE_BATCH_CHUNK; data[i++] = value);
+	return lane;
+}
+
+static int te_batch_boolean(te_batch *batch, int value)
+{
+	int lane = te_batch_lane(batch, TE_TYPE_BOOLEAN, 1);
+
+	memset(batch->lane[lane].data, value != 0, TE_BATCH_CHUNK);
+	return lane;
+}
+
+static int te_batch_emit(te_batch *batch, int op, te_type type, int one, int two, int three)
+{
+	te_step *step;
+
+	if (batch->step_count >= batch->step_cap)
+	{
+		batch->step_cap = batch->step_cap ? batch->step_cap * 2 : 16;
+		batch->step = te_realloc(batch->step, sizeof(te_step) * batch->step_cap);
+		assert(batch->step);
+	}
+
+	step = &batch->step[batch->step_count++];
+	step->op = op;
+	step->out = te_batch_lane(batch, type, 1);
+	step->one = one;
+	step->two = two;
+	step->three = three;
+
+	return step->out;
+}
+
+static int te_batch_numeric(te_batch *batch, int lane)
+{
+	te_type type = batch->lane[lane].type;
+
+	return type == TE_TYPE_INTEGER || type == TE_TYPE_NUMBER;
+}
+
+static int te_batch_to_number(te_batch *batch, int lane)
+{
+	if (batch->lane[lane].type == TE_TYPE_INTEGER)
+		return te_batch_emit(batch, TE_BATCH_TO_NUMBER, TE_TYPE_NUMBER, lane, -1, -1);
+
+	return lane;
+}
+
+/*
+ * Combines two numeric lanes, in double unless both are integers.
+ * Comparisons give booleans.
+ */
+static int te_batch_binary(te_batch *batch, int op, int one, int two)
+{
+	te_type type = op >= TE_BATCH_EQ ? TE_TYPE_BOOLEAN : TE_TYPE_NUMBER;
+
+	if (op != TE_BATCH_DIV && batch->lane[one].type == TE_TYPE_INTEGER &&
+		batch->lane[two].type == TE_TYPE_INTEGER)
+		return te_batch_emit(batch, op, op >= TE_BATCH_EQ ? type : TE_TYPE_INTEGER, one, two, -1);
+
+	one = te_batch_to_number(batch, one);
+	two = te_batch_to_number(batch, two);
+
+	return te_batch_emit(batch, op, type, one, two, -1);
+}
+
+static int te_batch_plan(te_batch *batch, te_node *node);
+
+/* Plans the operands of node from first on; returns 0 if one cannot be. */
+static int te_batch_plan_operands(te_batch *batch, te_node *node, int first, int *lane, te_type type)
+{
+	int i;
+
+	for (i = first; i < node->child_count; i++)
+	{
+		lane[i] = te_batch_plan(batch, node->child[i]);
+
+		if (lane[i] < 0)
+			return 0;
+
+		if (type == TE_TYPE_BOOLEAN ? batch->lane[lane[i]].type != type : !te_batch_numeric(batch, lane[i]))
+			return 0;
 	}
 
-	return 0;
+	return 1;
 }
 
-static te_object* te_result_from_number(tiny_eval *te, double value, te_type type)
+/* Mirrors te_arith_fold and the other builtins, operand check for check. */
+static int te_batch_plan_apply(te_batch *batch, te_node *node, te_native native)
 {
-	te_object *result = NULL;
+	int count = node->child_count - 1;
+	int *lane;
+	int result = -1;
+	int i;
 
-	assert(te);
+	if (native == te_not)
+	{
+		if (count != 1 || (result = te_batch_plan(batch, node->child[1])) < 0)
+			return -1;
 
-	if (!te_error(te))
+		if (batch->lane[result].type == TE_TYPE_BOOLEAN)
+			return te_batch_emit(batch, TE_BATCH_NOT, TE_TYPE_BOOLEAN, result, -1, -1);
+
+		return te_batch_boolean(batch, 0);
+	}
+
+	lane = te_alloc(sizeof(int) * (count + 1));
+	assert(lane);
+
+	if (te_batch_plan_operands(batch, node, 1, lane, TE_TYPE_NUMBER))
 	{
-		if (type == TE_TYPE_INTEGER)
+		if (native == te_plus || native == te_multiplies)
+		{
+			int op = native == te_plus ? TE_BATCH_ADD : TE_BATCH_MUL;
+
+			result = count ? lane[1] : te_batch_integer(batch, op == TE_BATCH_ADD ? 0 : 1);
+
+			for (i = 2; i <= count; i++)
+				result = te_batch_binary(batch, op, result, lane[i]);
+		}
+		else if (native == te_minus && count == 1)
 		{
-			return te_make_integer((long)value);
+			/* 0 - x would give +0.0 for 0.0, so numbers are multiplied instead. */
+			if (batch->lane[lane[1]].type == TE_TYPE_INTEGER)
+				result = te_batch_binary(batch, TE_BATCH_SUB, te_batch_integer(batch, 0), lane[1]);
+			else
+				result = te_batch_binary(batch, TE_BATCH_MUL, te_batch_number(batch, -1), lane[1]);
 		}
-		else if (type == TE_TYPE_NUMBER)
+		else if (native == te_divides && count == 1)
+		{
+			result = te_batch_binary(batch, TE_BATCH_DIV, te_batch_number(batch, 1), lane[1]);
+		}
+		else if ((native == te_minus || native == te_divides) && count > 1)
+		{
+			int op = native == te_minus ? TE_BATCH_SUB : TE_BATCH_DIV;
+
+			result = lane[1];
+
+			for (i = 2; i <= count; i++)
+				result = te_batch_binary(batch, op, result, lane[i]);
+		}
+		else if (native != te_minus && native != te_divides)
 		{
-			return te_make_number(value);
+			int op = native == te_equal ? TE_BATCH_EQ :
+				native == te_lesser ? TE_BATCH_LT :
+				native == te_lesser_equal ? TE_BATCH_LE :
+				native == te_greater ? TE_BATCH_GT : TE_BATCH_GE;
+
+			result = te_batch_boolean(batch, 1);
+
+			for (i = 2; i <= count; i++)
+			{
+				int pair = te_batch_binary(batch, op, lane[i - 1], lane[i]);
+
+				result = i == 2 ? pair : te_batch_emit(batch, TE_BATCH_AND, TE_TYPE_BOOLEAN, result, pair, -1);
+			}
 		}
 	}
 
+	te_free(lane);
 	return result;
 }
 
-TE_PROC(te_plus)
+/*
+ * Returns the lane holding node's value for a chunk, emitting the steps
+ * that compute it, or -1 if it can only be evaluated row by row.
+ */
+static int te_batch_plan(te_batch *batch, te_node *node)
 {
-	double value = 0;
-	te_type result_type = TE_TYPE_INTEGER;
+	te_symbol *cell;
+	te_native native;
+	te_value value;
+	int *lane;
+	int result;
 	int i;
 
-	UNUSED(user);
-
-	for (i = 0; i < count && !te_error(te); i++)
+	switch (node->type)
 	{
-		te_type operand_type;
-		value += te_extract_number(te, operands[i], &operand_type);
-		if (operand_type == TE_TYPE_NUMBER)
-			result_type = TE_TYPE_NUMBER;
-	}
+	case TE_NODE_CONSTANT:
+		switch (te_object_type(node->object))
+		{
+		case TE_TYPE_INTEGER:
+			return te_batch_integer(batch, node->object->data.int_value);
 
-	return te_result_from_number(te, value, result_type);
-}
+		case TE_TYPE_NUMBER:
+			return te_batch_number(batch, node->object->data.num_value);
 
-TE_PROC(te_minus)
-{
-	te_object *result = NULL;
-	te_type result_type;
-	double value = 0;
+		case TE_TYPE_BOOLEAN:
+			return te_batch_boolean(batch, (int)node->object->data.int_value);
+		}
+		break;
 
-	UNUSED(user);
+	case TE_NODE_SYMBOL:
+		for (i = batch->column_count - 1; i >= 0; i--)
+		{
+			if (batch->name[i] == node->name)
+				return i;
+		}
 
-	if (count == 1)
-	{
-		value = te_extract_number(te, operands[0], &result_type);
-		result = te_result_from_number(te, -value, result_type);
-	}
-	else if (count > 1)
-	{
-		int i;
+		cell = te_global_find(batch->te, node->name);
+		value = cell ? cell->value : TE_VALUE_UNBOUND;
+
+		switch (te_value_type(value))
+		{
+		case TE_TYPE_INTEGER:
+			return te_batch_integer(batch, te_value_integer(value));
 
-		value = te_extract_number(te, operands[0], &result_type);
+		case TE_TYPE_NUMBER:
+			return te_batch_number(batch, te_value_number(value));
 
-		for (i = 1; i < count && !te_error(te); i++)
+		case TE_TYPE_BOOLEAN:
+			return te_batch_boolean(batch, TE_VALUE_BOOLEAN(value));
+		}
+		break;
+
+	case TE_NODE_IF:
+		if (node->child_count == 3)
 		{
-			te_type operand_type;
-			value -= te_extract_number(te, operands[i], &operand_type);
-			if (operand_type == TE_TYPE_NUMBER)
-				result_type = TE_TYPE_NUMBER;
+			int lanes[3];
+
+			for (i = 0; i < 3; i++)
+			{
+				if ((lanes[i] = te_batch_plan(batch, node->child[i])) < 0)
+					return -1;
+			}
+
+			if (batch->lane[lanes[0]].type != TE_TYPE_BOOLEAN ||
+				batch->lane[lanes[1]].type != batch->lane[lanes[2]].type)
+				break;
+
+			return te_batch_emit(batch, TE_BATCH_SELECT, batch->lane[lanes[1]].type, lanes[0], lanes[1], lanes[2]);
 		}
+		break;
 
-		result = te_result_from_number(te, value, result_type);
-	}
-	else
-	{
-		te_set_error(te, "minus: require at least 1 operand");
+	case TE_NODE_AND:
+	case TE_NODE_OR:
+		lane = te_alloc(sizeof(int) * (node->child_count + 1));
+		assert(lane);
+
+		result = -1;
+
+		if (te_batch_plan_operands(batch, node, 0, lane, TE_TYPE_BOOLEAN))
+		{
+			result = te_batch_boolean(batch, node->type == TE_NODE_AND);
+
+			for (i = 0; i < node->child_count; i++)
+			{
+				result = i == 0 ? lane[0] : te_batch_emit(batch,
+					node->type == TE_NODE_AND ? TE_BATCH_AND : TE_BATCH_OR,
+					TE_TYPE_BOOLEAN, result, lane[i], -1);
+			}
+		}
+
+		te_free(lane);
+		return result;
+
+	case TE_NODE_APPLY:
+		if (node->child[0]->type != TE_NODE_SYMBOL)
+			break;
+
+		for (i = 0; i < batch->column_count; i++)
+		{
+			if (batch->name[i] == node->child[0]->name)
+				return -1;
+		}
+
+		cell = te_global_find(batch->te, node->child[0]->name);
+
+		if (!cell || te_value_type(cell->value) != TE_TYPE_PROCEDURE)
+			break;
+
+		native = TE_VALUE_OBJECT(cell->value)->data.procedure->native;
+
+		if (te_native_pure(native))
+			return te_batch_plan_apply(batch, node, native);
+		break;
 	}
 
-	return result;
+	return -1;
 }
 
-TE_PROC(te_multiplies)
+/* Runs the steps over n rows from row; returns 0 if an integer overflowed. */
+static int te_batch_chunk(te_batch *batch, size_t row, int n)
 {
-	double value = 1;
-	te_type result_type = TE_TYPE_INTEGER;
+	te_lane *lane = batch->lane;
+	int fits = 1;
 	int i;
 
-	UNUSED(user);
+	for (i = 0; i < batch->column_count; i++)
+		lane[i].data = (char*)batch->column[i].data + te_batch_size(lane[i].type) * row;
 
-	for (i = 0; i < count && !te_error(te); i++)
+	for (i = 0; i < batch->step_count && fits; i++)
 	{
-		te_type operand_type;
-		value *= te_extract_number(te, operands[i], &operand_type);
-		if (operand_type == TE_TYPE_NUMBER)
-			result_type = TE_TYPE_NUMBER;
+		te_step *step = &batch->step[i];
+		void *out = lane[step->out].data;
+		void *one = lane[step->one].data;
+		void *two = step->two >= 0 ? lane[step->two].data : NULL;
+		te_type type = lane[step->one].type;
+
+		switch (step->op)
+		{
+		case TE_BATCH_TO_NUMBER:
+			te_kernel_to_number(out, one, n);
+			break;
+
+		case TE_BATCH_ADD:
+			if (type == TE_TYPE_INTEGER)
+				fits = te_kernel_add_integer(out, one, two, n);
+			else
+				te_kernel_add_number(out, one, two, n);
+			break;
+
+		case TE_BATCH_SUB:
+			if (type == TE_TYPE_INTEGER)
+				fits = te_kernel_sub_integer(out, one, two, n);
+			else
+				te_kernel_sub_number(out, one, two, n);
+			break;
+
+		case TE_BATCH_MUL:
+			if (type == TE_TYPE_INTEGER)
+				fits = te_kernel_mul_integer(out, one, two, n);
+			else
+				te_kernel_mul_number(out, one, two, n);
+			break;
+
+		case TE_BATCH_DIV:
+			te_kernel_div_number(out, one, two, n);
+			break;
+
+		case TE_BATCH_EQ:
+		case TE_BATCH_LT:
+		case TE_BATCH_LE:
+		case TE_BATCH_GT:
+		case TE_BATCH_GE:
+			if (type == TE_TYPE_INTEGER)
+				te_kernel_compare_integer[step->op - TE_BATCH_EQ](out, one, two, n);
+			else
+				te_kernel_compare_number[step->op - TE_BATCH_EQ](out, one, two, n);
+			break;
+
+		case TE_BATCH_NOT:
+			te_kernel_not(out, one, n);
+			break;
+
+		case TE_BATCH_AND:
+			te_kernel_and(out, one, two, n);
+			break;
+
+		case TE_BATCH_OR:
+			te_kernel_or(out, one, two, n);
+			break;
+
+		case TE_BATCH_SELECT:
+			type = lane[step->two].type;
+
+			if (type == TE_TYPE_INTEGER)
+				te_kernel_select_integer(out, one, two, lane[step->three].data, n);
+			else if (type == TE_TYPE_NUMBER)
+				te_kernel_select_number(out, one, two, lane[step->three].data, n);
+			else
+				te_kernel_select_boolean(out, one, two, lane[step->three].data, n);
+			break;
+		}
 	}
 
-	return te_result_from_number(te, value, result_type);
+	return fits;
 }
 
-TE_PROC(te_divides)
+static te_value te_batch_load(const te_column *column, size_t row)
 {
-	te_object *result = NULL;
-	double value = 1;
+	if (column->type == TE_TYPE_INTEGER)
+		return te_value_from_integer(((const te_int64*)column->data)[row]);
 
-	UNUSED(user);
-	
-	if (count == 1)
+	if (column->type == TE_TYPE_NUMBER)
+		return te_value_from_number(((const double*)column->data)[row]);
+
+	return TE_VALUE_FROM_BOOLEAN(((const unsigned char*)column->data)[row] != 0);
+}
+
+static int te_batch_store(tiny_eval *te, te_column *output, size_t row, te_value value)
+{
+	te_type type = te_value_type(value);
+
+	if (output->type == TE_TYPE_INTEGER && type == TE_TYPE_INTEGER)
+		((te_int64*)output->data)[row] = te_value_integer(value);
+	else if (output->type == TE_TYPE_NUMBER && (type == TE_TYPE_INTEGER || type == TE_TYPE_NUMBER))
+		((double*)output->data)[row] = te_value_number(value);
+	else if (output->type == TE_TYPE_BOOLEAN && type == TE_TYPE_BOOLEAN)
+		((unsigned char*)output->data)[row] = (unsigned char)TE_VALUE_BOOLEAN(value);
+	else
 	{
-		te_type operand_type;
-		value /= te_extract_number(te, operands[0], &operand_type);
-		result = te_result_from_number(te, value, TE_TYPE_NUMBER);
+		te_set_error(te, "batch: result does not fit the output column");
+		return 0;
 	}
-	else if (count > 1)
-	{
-		int i;
-		te_type operand_type;
 
-		value = te_extract_number(te, operands[0], &operand_type);
+	return 1;
+}
 
-		for (i = 1; i < count && !te_error(te); i++)
-			value /= te_extract_number(te, operands[i], &operand_type);
+/* Evaluates one row with the compiled code; cell holds the columns. */
+static int te_batch_row(te_batch *batch, te_program *program, te_symbol **cell, te_column *output, size_t row)
+{
+	tiny_eval *te = batch->te;
+	te_value value;
+	int stored = 0;
+	int i;
 
-		result = te_result_from_number(te, value, TE_TYPE_NUMBER);
-	}
-	else
+	for (i = 0; i < batch->column_count; i++)
 	{
-		te_set_error(te, "divides: require at least 1 operand");
+		te_value_release(cell[i]->value);
+		cell[i]->value = te_batch_load(&batch->column[i], row);
 	}
 
-	return result;
+	value = te_execute(te, program->code, NULL);
+
+	if (!te_error(te))
+		stored = te_batch_store(te, output, row, value);
+
+	te_value_release(value);
+	return stored;
 }
 
-static TE_PROC(te_not)
+/*
+ * Evaluates program once for each of rows rows, with every column bound
+ * to its value in that row, and writes the results to output. Columns
+ * of TE_TYPE_INTEGER hold 64-bit integers, TE_TYPE_NUMBER doubles and
+ * TE_TYPE_BOOLEAN unsigned chars. An integer result fits a number
+ * column; other mismatches are errors. Returns the number of rows
+ * written, which is rows unless te_error says otherwise.
+ */
+size_t te_eval_batch(tiny_eval *te, te_program *program, const te_column columns[], int count, te_column *output, size_t rows)
 {
-	te_object *result = NULL;
+	te_batch batch;
+	te_symbol **cell;
+	te_value *saved;
+	tiny_eval *prev;
+	size_t done = 0;
+	size_t row;
+	int result = -1;
+	int n;
+	int i;
 
-	UNUSED(user);
+	assert(te);
+	assert(program);
+	assert(output);
+	assert(columns || count == 0);
 
-	if (count == 1)
-	{
-		int value = 0;
-		te_type type = te_object_type(operands[0]);
-		
-		if (type == TE_TYPE_BOOLEAN)
-			value = !te_to_boolean(operands[0]);
+	te_set_error(te, NULL);
 
-		result = te_make_boolean(value);
-	}
-	else
+	for (i = 0; i < count; i++)
 	{
-		te_set_error(te, "not: requires exactly 1 operand");
+		if (!te_batch_type(columns[i].type))
+			te_set_error(te, "batch: unsupported column type");
 	}
 
-	return result;
-}
-
-#define TE_COMPARE_PROC(name,op) \
-static TE_PROC(name) \
-{ \
-	te_object *result = NULL; \
-\
-	UNUSED(user);\
-\
-	if (count == 1) \
-	{ \
-		te_type type = te_object_type(operands[0]); \
-		if (type == TE_TYPE_NUMBER || type == TE_TYPE_INTEGER) \
-		{ \
-			result = te_make_true(); \
-		} \
-		else \
-		{ \
-			te_set_error(te, "operand is not a number"); \
-		} \
-	} \
-	else if (count > 1) \
-	{ \
-		int i; \
-		int op_result = 1; \
-\
-		for (i = 1; op_result && i < count && !te_error(te); i++) \
-		{ \
-			te_type type_one, type_two; \
-			double one, two; \
-\
-			one = te_extract_number(te, operands[i - 1], &type_one); \
-			two = te_extract_number(te, operands[i], &type_two); \
-\
-			if (!te_error(te)) \
-				op_result = (one op two); \
-		} \
-\
-		if (!te_error(te)) \
-			result = te_make_boolean(op_result); \
-	} \
-	else \
-	{ \
-		result = te_make_true(); \
-	} \
-\
-	return result; \
-}
+	if (!te_batch_type(output->type))
+		te_set_error(te, "batch: unsupported column type");
 
-TE_COMPARE_PROC(te_equal, ==)
-TE_COMPARE_PROC(te_lesser, <)
-TE_COMPARE_PROC(te_lesser_equal, <=)
-TE_COMPARE_PROC(te_greater, >)
-TE_COMPARE_PROC(te_greater_equal, >=)
+	if (te_error(te))
+		return 0;
 
-static TE_PROC(te_display)
-{
-	UNUSED(user);
+	prev = te_current;
+	te_current = te;
 
-	if (count == 1)
-	{
-		te_type type = te_object_type(operands[0]);
+	te_batch_init(&batch, te, columns, count);
 
-		switch (type)
-		{
-		case TE_TYPE_NIL:
-			printf("#!unspecific");
-			break;
+	cell = te_alloc(sizeof(te_symbol*) * (count + 1));
+	saved = te_alloc(sizeof(te_value) * (count + 1));
+	assert(cell);
+	assert(saved);
 
-		case TE_TYPE_PROCEDURE:
-			printf("#[compound-procedure]");
-			break;
+	for (i = 0; i < count; i++)
+	{
+		cell[i] = te_global_cell(te, batch.name[i]);
+		saved[i] = cell[i]->value;
+		cell[i]->value = TE_VALUE_NIL;
+		cell[i]->column = 1;
+	}
 
-		case TE_TYPE_USERDATA:
-			printf("#[user-data]");
-			break;
+	te->global_version++;
 
-		case TE_TYPE_INTEGER:
-			printf("%ld", te_to_integer(operands[0]));
-			break;
+	if (program->body->child_count == 1)
+		result = te_batch_plan(&batch, program->body->child[0]);
 
-		case TE_TYPE_NUMBER:
-			printf("%g", te_to_number(operands[0]));
-			break;
+	if (result >= 0 && output->type == TE_TYPE_NUMBER)
+		result = te_batch_to_number(&batch, result);
 
-		case TE_TYPE_STRING:
-			printf("%s", te_to_string(operands[0]));
-			break;
+	if (result >= 0 && batch.lane[result].type != output->type)
+		result = -1;
 
-		case TE_TYPE_BOOLEAN:
-			if (te_to_boolean(operands[0]) == 0)
-				printf("#f");
-			else
-				printf("#t");
-			break;
+	for (row = 0; row < rows && !te_error(te); row += n)
+	{
+		n = rows - row < TE_BATCH_CHUNK ? (int)(rows - row) : TE_BATCH_CHUNK;
 
-		default:
-			printf("#!unspecific");
-			break;
+		if (result >= 0 && te_batch_chunk(&batch, row, n))
+		{
+			memmove((char*)output->data + te_batch_size(output->type) * row,
+				batch.lane[result].data, te_batch_size(output->type) * n);
+			done = row + n;
+		}
+		else
+		{
+			for (i = 0; i < n && te_batch_row(&batch, program, cell, output, row + i); i++);
+			done = row + i;
 		}
 	}
-	else
+
+	for (i = count - 1; i >= 0; i--)
 	{
-		te_set_error(te, "display: requires 1 operand");
+		te_value_release(cell[i]->value);
+		cell[i]->value = saved[i];
+		cell[i]->column = 0;
 	}
 
-	return NULL;
-}
+	te->global_version++;
 
-static TE_PROC(te_newline)
-{
-	UNUSED(te);
-	UNUSED(user);
-	UNUSED(operands);
-	UNUSED(count);
+	te_free(cell);
+	te_free(saved);
+	te_batch_release(&batch);
 
-	printf("\n");
-	return NULL;
+	te_current = prev;
+
+	return done;
 }
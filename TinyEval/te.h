@@ -28,18 +28,61 @@ wane <newsheep@gmail.com>
 #ifndef __TINY_EVAL_H__
 #define __TINY_EVAL_H__
 
+#include <stddef.h>
+
 typedef struct tag_tiny_eval tiny_eval;
 typedef struct tag_te_object te_object;
+typedef struct tag_te_program te_program;
+
+typedef void* (*te_alloc_func)(void *user, size_t size);
+typedef void (*te_free_func)(void *user, void *p, size_t size);
 
 tiny_eval* te_init(void);
+tiny_eval* te_init_with_allocator(te_alloc_func alloc, te_free_func release, void *user);
 void te_release(tiny_eval *te);
 
+/*
+ * The memory limit is soft. Lambda calls that would go over it are
+ * refused, but any other allocation that goes over it is still made
+ * and only fails what te is doing with "memory: limit exceeded": the
+ * compile stops, or the run stops at its next call and returns NULL.
+ */
+void te_set_memory_limit(tiny_eval *te, unsigned long limit);
+
+void te_set_max_depth(tiny_eval *te, int depth);
+
 void te_define(tiny_eval *te, const char *symbol, te_object *object);
 te_object* te_eval(tiny_eval *te, const char *expression);
 
+te_object* te_eval_region(tiny_eval *te, const char *expression);
+void te_region_reset(tiny_eval *te);
+
+te_program* te_compile(tiny_eval *te, const char *expression);
+te_object* te_run(tiny_eval *te, te_program *program);
+void te_program_release(te_program *program);
+
 const char *te_error(tiny_eval *te);
 void te_set_error(tiny_eval *te, const char *str);
 
+typedef struct tag_te_stats
+{
+	unsigned long objects;
+	unsigned long objects_peak;
+	unsigned long allocations;
+	unsigned long slabs;
+	unsigned long collections;
+	unsigned long bytes;
+	unsigned long bytes_peak;
+}
+te_stats;
+
+void te_stats_get(tiny_eval *te, te_stats *stats);
+
+void te_gc_enable(tiny_eval *te, int enabled);
+void te_gc_collect(tiny_eval *te);
+void te_gc_root(tiny_eval *te, te_object *object);
+void te_gc_unroot(tiny_eval *te, te_object *object);
+
 #define TE_TYPE_NIL       0
 #define TE_TYPE_PROCEDURE 1
 #define TE_TYPE_USERDATA  2
@@ -50,6 +93,22 @@ void te_set_error(tiny_eval *te, const char *str);
 
 typedef int te_type;
 
+#ifdef _MSC_VER
+typedef __int64 te_int64;
+#else
+typedef long long te_int64;
+#endif
+
+typedef struct tag_te_column
+{
+	const char *name;
+	te_type type;
+	void *data;
+}
+te_column;
+
+size_t te_eval_batch(tiny_eval *te, te_program *program, const te_column columns[], int count, te_column *output, size_t rows);
+
 te_type te_object_type(te_object *object);
 te_object* te_object_retain(te_object *object);
 void te_object_release(te_object *object);
@@ -63,6 +122,7 @@ te_object* te_make_nil(void);
 te_object* te_make_procedure(te_procedure proc, void *user);
 te_object* te_make_userdata(void *user);
 te_object* te_make_integer(long value);
+te_object* te_make_int64(te_int64 value);
 te_object* te_make_number(double number);
 te_object* te_make_str(const char *str);
 te_object* te_make_string(const char *str, const char *end);
@@ -73,6 +133,7 @@ te_object* te_make_false();
 te_object* te_call(tiny_eval *te, te_object *procedure, te_object *operands[], int count);
 void* te_to_userdata(te_object *object);
 long te_to_integer(te_object *object);
+te_int64 te_to_int64(te_object *object);
 double te_to_number(te_object *object);
 const char* te_to_string(te_object *object);
 int te_to_boolean(te_object *object);